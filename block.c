@@ -7,34 +7,776 @@
  *
  */
 
+#define _GNU_SOURCE		/* fallocate() */
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/falloc.h>
+#undef BLOCK_SIZE	/* <linux/fs.h> has its own */
 
 #include "block.h"
 
-//Disk size set to 32MB
-#define DISK_SIZE	32*1024*1024
-
 int diskfile = -1;
+int block_size = BLOCK_SIZE_MIN;
+
+/*
+ * Memory-mapped backend
+ *
+ * When enabled with dev_use_mmap() before the disk is opened, the disk file
+ * is mapped shared into one BIO_MMAP_MAX reservation and blocks are accessed
+ * in place instead of through the buffer cache. The file is grown on demand
+ * when a block past its end is touched, so the mapping never has to move and
+ * pointers from bio_get() stay valid. Dirty pages are pushed with msync().
+ * map_lock serializes growing the file.
+ */
+static int use_mmap = 0;
+static char *disk_map = NULL;
+static off_t disk_len = 0;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * io_uring backend
+ *
+ * Multi-block transfers (bio_readv, bio_writev and cache writeback) are
+ * described as a list of io_reqs and handed to dev_submit(). With io_uring
+ * enabled through dev_use_uring() every request of the list is queued on
+ * the ring and submitted in one io_uring_enter(), and completions are reaped
+ * as they arrive, so the device sees the whole batch at once. Without it, or
+ * if the kernel refuses to set up a ring, the requests run one by one with
+ * preadv/pwritev. The ring is shared, so ring_lock lets one batch use it
+ * at a time.
+ */
+struct io_req {
+	int			write;			/* 1 for pwritev, 0 for preadv */
+	off_t		off;			/* byte offset in the disk file */
+	struct iovec *iov;
+	int			niov;
+	ssize_t		res;			/* bytes transferred or -errno */
+};
+
+struct uring {
+	int			fd;
+	unsigned	entries;
+	unsigned	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned	*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void		*sq_ptr, *cq_ptr;
+	size_t		sq_len, cq_len;
+};
+
+static int use_uring = 0;
+static struct uring ring = { .fd = -1 };
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int uring_setup() {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, BIO_URING_DEPTH, &p);
+	if (ring.fd < 0) {
+		return -1;
+	}
+
+	ring.entries = p.sq_entries;
+	ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_len > ring.sq_len) {
+			ring.sq_len = ring.cq_len;
+		}
+		ring.cq_len = ring.sq_len;
+	}
+	ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.cq_ptr = ring.sq_ptr;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) && ring.sq_ptr != MAP_FAILED) {
+		ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	}
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sq_ptr == MAP_FAILED || ring.cq_ptr == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		close(ring.fd);
+		ring.fd = -1;
+		return -1;
+	}
+
+	char *sq = ring.sq_ptr, *cq = ring.cq_ptr;
+	ring.sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring.sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring.cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring.cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 0;
+}
+
+static void uring_teardown() {
+	if (ring.fd < 0) {
+		return;
+	}
+	munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+	if (ring.cq_ptr != ring.sq_ptr) {
+		munmap(ring.cq_ptr, ring.cq_len);
+	}
+	munmap(ring.sq_ptr, ring.sq_len);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+//Bytes a request asks for
+static size_t req_len(const struct io_req *r) {
+	size_t len = 0;
+	for (int i = 0; i < r->niov; i++) {
+		len += r->iov[i].iov_len;
+	}
+	return len;
+}
+
+//Carry a request that came back short (or interrupted, res 0) through to
+//the end with preadv/pwritev. A read stops early at the end of the disk
+//file; a write that makes no progress fails.
+static void req_finish(struct io_req *r) {
+	size_t len = req_len(r);
+	if (r->res < 0 || (size_t) r->res >= len) {
+		return;
+	}
+	struct iovec *iov = malloc(r->niov * sizeof(struct iovec));
+	while ((size_t) r->res < len) {
+		//The part of the vector not transferred yet
+		size_t skip = r->res;
+		int k = 0;
+		while (skip >= r->iov[k].iov_len) {
+			skip -= r->iov[k].iov_len;
+			k++;
+		}
+		int n = r->niov - k;
+		memcpy(iov, &r->iov[k], n * sizeof(struct iovec));
+		iov[0].iov_base = (char *) iov[0].iov_base + skip;
+		iov[0].iov_len -= skip;
+
+		ssize_t got = r->write
+			? pwritev(diskfile, iov, n, r->off + r->res)
+			: preadv(diskfile, iov, n, r->off + r->res);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		}
+		if (got < 0) {
+			r->res = -errno;
+			break;
+		}
+		if (got == 0) {
+			if (r->write) {
+				r->res = -EIO;
+			}
+			break;
+		}
+		r->res += got;
+	}
+	free(iov);
+}
+
+//Reap whatever has completed on the ring into reqs, returning how many
+static int uring_reap(struct io_req *reqs) {
+	int reaped = 0;
+	unsigned head = *ring.cq_head;
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		int res = cqe->res;
+		reqs[cqe->user_data].res = res == -EINTR || res == -EAGAIN ? 0 : res;
+		head++;
+		reaped++;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	return reaped;
+}
+
+//Run a batch of requests, on the ring if there is one. Short transfers are
+//resubmitted for the rest. Returns -1 if any failed.
+static int dev_submit(struct io_req *reqs, int n) {
+	int retstat = 0;
+	if (ring.fd < 0) {
+		for (int i = 0; i < n; i++) {
+			reqs[i].res = reqs[i].write
+				? pwritev(diskfile, reqs[i].iov, reqs[i].niov, reqs[i].off)
+				: preadv(diskfile, reqs[i].iov, reqs[i].niov, reqs[i].off);
+			if (reqs[i].res < 0) {
+				reqs[i].res = errno == EINTR ? 0 : -errno;
+			}
+			req_finish(&reqs[i]);
+			if (reqs[i].res < 0) {
+				retstat = -1;
+			}
+		}
+		return retstat;
+	}
+
+	//unsubmitted counts the entries queued on the ring that the kernel has
+	//not consumed yet, e.g. because io_uring_enter() was interrupted. A
+	//request the ring never completes keeps res 0 and is done by req_finish()
+	int queued = 0, completed = 0, inflight = 0, unsubmitted = 0;
+	for (int i = 0; i < n; i++) {
+		reqs[i].res = 0;
+	}
+	pthread_mutex_lock(&ring_lock);
+	while (completed < n) {
+		//Queue as much of the batch as the ring has room for
+		unsigned tail = *ring.sq_tail;
+		while (queued < n && inflight < (int) ring.entries) {
+			unsigned idx = tail & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = reqs[queued].write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = diskfile;
+			sqe->addr = (unsigned long) reqs[queued].iov;
+			sqe->len = reqs[queued].niov;
+			sqe->off = reqs[queued].off;
+			sqe->user_data = queued;
+			ring.sq_array[idx] = idx;
+			tail++;
+			queued++;
+			inflight++;
+			unsubmitted++;
+		}
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+		int ret = syscall(__NR_io_uring_enter, ring.fd, unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			//The requests in flight point into reqs, so they must all be
+			//reaped before we return; the kernel never saw the unsubmitted
+			//ones, so take them back. The rest of the batch is done
+			//synchronously by req_finish().
+			perror("io_uring_enter failed");
+			__atomic_store_n(ring.sq_tail, tail - unsubmitted, __ATOMIC_RELEASE);
+			inflight -= unsubmitted;
+			while (inflight > 0) {
+				int got = uring_reap(reqs);
+				inflight -= got;
+				if (got == 0 && syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+					sched_yield();
+				}
+			}
+			break;
+		}
+		if (ret > 0) {
+			unsubmitted -= ret < unsubmitted ? ret : unsubmitted;
+		}
+
+		//Reap whatever has completed
+		int got = uring_reap(reqs);
+		completed += got;
+		inflight -= got;
+	}
+	pthread_mutex_unlock(&ring_lock);
+
+	for (int i = 0; i < n; i++) {
+		req_finish(&reqs[i]);
+		if (reqs[i].res < 0) {
+			retstat = -1;
+		}
+	}
+	return retstat;
+}
+
+//Select the io_uring backend for the next dev_init()/dev_open()
+void dev_use_uring(int enable) {
+	use_uring = enable;
+}
+
+static void dev_start_uring() {
+	if (use_uring && ring.fd < 0 && uring_setup() < 0) {
+		perror("io_uring setup failed, falling back to preadv/pwritev");
+	}
+}
+
+/*
+ * Buffer cache
+ *
+ * Every block that goes through bio_read/bio_write is kept in a fixed pool of
+ * BCACHE_NBUF buffers, found through a hash on the block number and recycled
+ * in LRU order. Writes only dirty the buffer; dirty buffers reach the disk
+ * when dev_flush()/dev_sync() is called or when one has to be evicted.
+ *
+ * bcache_lock guards the hash, LRU list, pins and dirty flags; the contents
+ * of a pinned block are guarded by whoever pinned it (the inode or
+ * allocator lock above). No disk I/O is done with the lock held: a buffer
+ * being read in or written back is marked busy, the lock is dropped for the
+ * transfer, and lookups that find a busy buffer wait on bcache_cond.
+ *
+ * Once a journal is running (bio_log_start()), every block changed through
+ * bio_write()/bio_put() is tagged with the journal transaction in progress
+ * and held in the cache, neither written back nor evicted, until that
+ * transaction has been committed to the journal. A lookup that finds every
+ * buffer pinned or held waits for one to be let go.
+ */
+struct buf {
+	int			blkno;			/* cached block number, -1 if unused */
+	int			dirty;			/* buffer differs from disk */
+	int			pins;			/* outstanding bio_get() references */
+	int			busy;			/* being read in or written back, lock dropped */
+	unsigned	jseq;			/* journal transaction that last changed it, 0 if none */
+	struct buf	*hnext;			/* next buffer in the same hash chain */
+	struct buf	*prev;			/* LRU list, head is most recently used */
+	struct buf	*next;
+	char		*data;			/* BLOCK_SIZE bytes */
+};
+
+static struct buf *bufs = NULL;
+static struct buf *hash_tbl[BCACHE_NHASH];
+static struct buf lru;			/* list head, lru.next is MRU, lru.prev is LRU */
+static char *buf_pool = NULL;
+static pthread_mutex_t bcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bcache_cond = PTHREAD_COND_INITIALIZER;	/* a busy buffer is done */
+static int bcache_nbusy = 0;			/* buffers busy, or pinned by dev_flush() */
+static int bcache_nwait = 0;			/* bcache_alloc() calls waiting for a free buffer */
+static int discard_ok = 1;				/* the disk file can punch holes */
+static int zero_ok = 1;					/* the disk file can zero ranges in place */
+static unsigned long bcache_wseq = 0;	/* bumped when blocks reach the disk file */
+static unsigned log_seq = 0;			/* journal transaction being logged, 0 if none */
+static unsigned log_done = 0;			/* last transaction committed to the journal */
+static int log_count = 0;				/* blocks tagged with log_seq */
+static int log_failed = 0;				/* a commit failed, held blocks are never released */
+
+static inline unsigned int bcache_hash(int block_num) {
+	return ((unsigned int) block_num * 2654435761u) % BCACHE_NHASH;
+}
+
+static void lru_unlink(struct buf *b) {
+	b->prev->next = b->next;
+	b->next->prev = b->prev;
+}
+
+static void lru_push_front(struct buf *b) {
+	b->next = lru.next;
+	b->prev = &lru;
+	lru.next->prev = b;
+	lru.next = b;
+}
+
+static void hash_remove(struct buf *b) {
+	struct buf **pp = &hash_tbl[bcache_hash(b->blkno)];
+	while (*pp != NULL) {
+		if (*pp == b) {
+			*pp = b->hnext;
+			break;
+		}
+		pp = &(*pp)->hnext;
+	}
+	b->hnext = NULL;
+}
 
-//Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+static void hash_insert(struct buf *b) {
+	unsigned int h = bcache_hash(b->blkno);
+	b->hnext = hash_tbl[h];
+	hash_tbl[h] = b;
+}
+
+static void bcache_init() {
+	if (bufs != NULL) {
+		return;
+	}
+
+	bufs = calloc(BCACHE_NBUF, sizeof(struct buf));
+	buf_pool = malloc((size_t) BCACHE_NBUF * BLOCK_SIZE);
+	if (bufs == NULL || buf_pool == NULL) {
+		perror("bcache_init failed");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(hash_tbl, 0, sizeof(hash_tbl));
+	lru.next = lru.prev = &lru;
+	for (int i = 0; i < BCACHE_NBUF; i++) {
+		bufs[i].blkno = -1;
+		bufs[i].data = buf_pool + (size_t) i * BLOCK_SIZE;
+		lru_push_front(&bufs[i]);
+	}
+}
+
+static void bcache_free() {
+	free(bufs);
+	free(buf_pool);
+	bufs = NULL;
+	buf_pool = NULL;
+}
+
+static struct buf *bcache_lookup(int block_num) {
+	struct buf *b = hash_tbl[bcache_hash(block_num)];
+	while (b != NULL && b->blkno != block_num) {
+		b = b->hnext;
+	}
+	return b;
+}
+
+static void bcache_wait(struct buf *b) {
+	while (b->busy) {
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+	}
+}
+
+//Look a block up, waiting out any transfer in progress on it. May drop
+//bcache_lock meanwhile.
+static struct buf *bcache_find(int block_num) {
+	struct buf *b;
+	while ((b = bcache_lookup(block_num)) != NULL && b->busy) {
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+	}
+	return b;
+}
+
+//A busy buffer's transfer is over, let the lookups waiting on it go
+static void bcache_ready(struct buf *b) {
+	b->busy = 0;
+	bcache_nbusy--;
+	pthread_cond_broadcast(&bcache_cond);
+}
+
+//Write a dirty buffer back, dropping bcache_lock for the write. It is marked
+//clean up front, so a change made through a pin during the write dirties it
+//again.
+static int bcache_writeback(struct buf *b) {
+	b->dirty = 0;
+	b->busy = 1;
+	bcache_nbusy++;
+	pthread_mutex_unlock(&bcache_lock);
+	int retstat = pwrite(diskfile, b->data, BLOCK_SIZE, (off_t) b->blkno * BLOCK_SIZE);
+	pthread_mutex_lock(&bcache_lock);
+	if (retstat < 0) {
+		perror("block_write failed");
+		b->dirty = 1;
+	}
+	bcache_wseq++;
+	bcache_ready(b);
+	return retstat;
+}
+
+//A block changed in a transaction not committed yet must stay off the disk
+static inline int bcache_held(struct buf *b) {
+	return b->jseq != 0 && (int) (b->jseq - log_done) > 0;
+}
+
+//Tag a block just changed with the journal transaction in progress
+static void bcache_log(struct buf *b) {
+	if (log_seq != 0 && b->jseq != log_seq) {
+		b->jseq = log_seq;
+		log_count++;
+	}
+}
+
+//Get the buffer for block_num, waiting out any transfer in progress on it.
+//If the block is not cached, the least recently used free buffer is
+//recycled for it (written back first if dirty) and returned busy with
+//*fresh set; the caller fills it and calls bcache_ready(). May drop
+//bcache_lock meanwhile, and waits while the only free buffers are busy.
+//Returns NULL if every buffer is pinned or held. Once the journal has
+//failed, held blocks will never reach the disk and are recycled like clean
+//ones.
+static struct buf *bcache_recycle(int block_num, int *fresh) {
+	*fresh = 0;
+	while (1) {
+		struct buf *b = bcache_find(block_num);
+		if (b != NULL) {
+			return b;
+		}
+		b = lru.prev;
+		while (b != &lru && (b->pins > 0 || b->busy || (bcache_held(b) && !log_failed))) {
+			b = b->prev;
+		}
+		if (b == &lru && bcache_nbusy > 0) {
+			pthread_cond_wait(&bcache_cond, &bcache_lock);
+			continue;
+		}
+		if (b == &lru) {
+			return NULL;
+		}
+		if (b->dirty && !bcache_held(b)) {
+			//A block that cannot be written back is given up on;
+			//somebody may have cached block_num meanwhile, so look again
+			if (bcache_writeback(b) < 0) {
+				b->dirty = 0;
+			}
+			continue;
+		}
+		if (b->blkno >= 0) {
+			hash_remove(b);
+		}
+		b->blkno = block_num;
+		b->dirty = 0;
+		b->jseq = 0;
+		b->busy = 1;
+		bcache_nbusy++;
+		hash_insert(b);
+		*fresh = 1;
+		return b;
+	}
+}
+
+//bcache_recycle(), waiting for a buffer to be unpinned or released by a
+//journal commit when none is free. The journal commits a transaction before
+//it grows past a quarter of the cache, so one always comes.
+static struct buf *bcache_alloc(int block_num, int *fresh) {
+	struct buf *b;
+	while ((b = bcache_recycle(block_num, fresh)) == NULL) {
+		bcache_nwait++;
+		pthread_cond_wait(&bcache_cond, &bcache_lock);
+		bcache_nwait--;
+	}
+	return b;
+}
+
+//Forget a stale or unwanted copy and make it the first buffer to recycle
+static void bcache_forget(struct buf *b) {
+	hash_remove(b);
+	b->blkno = -1;
+	b->dirty = 0;
+	lru_unlink(b);
+	b->prev = lru.prev;
+	b->next = &lru;
+	lru.prev->next = b;
+	lru.prev = b;
+}
+
+static void bcache_touch(struct buf *b) {
+	lru_unlink(b);
+	lru_push_front(b);
+}
+
+static int cmp_buf_blkno(const void *a, const void *b) {
+	return (*(struct buf **) a)->blkno - (*(struct buf **) b)->blkno;
+}
+
+static void dev_map() {
+	struct stat st;
+	if (fstat(diskfile, &st) < 0) {
+		perror("disk_stat failed");
+		exit(EXIT_FAILURE);
+	}
+	disk_len = st.st_size;
+	disk_map = mmap(NULL, BIO_MMAP_MAX, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+	if (disk_map == MAP_FAILED) {
+		perror("disk_mmap failed, falling back to pread/pwrite");
+		disk_map = NULL;
+	}
+}
+
+//Address of a block inside the mapping, growing the disk file to cover it
+static char *map_block(int block_num) {
+	off_t end = ((off_t) block_num + 1) * BLOCK_SIZE;
+	if (end > BIO_MMAP_MAX) {
+		fprintf(stderr, "block %d is past the mapped disk\n", block_num);
+		exit(EXIT_FAILURE);
+	}
+	if (end > __atomic_load_n(&disk_len, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&map_lock);
+		if (end > disk_len) {
+			if (ftruncate(diskfile, end) < 0) {
+				perror("disk_grow failed");
+				exit(EXIT_FAILURE);
+			}
+			__atomic_store_n(&disk_len, end, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&map_lock);
+	}
+	return disk_map + (off_t) block_num * BLOCK_SIZE;
+}
+
+/*
+ * Prefetch
+ *
+ * bio_prefetch() queues a range of blocks and returns at once; a worker
+ * thread reads each range with one pread() and drops the blocks that are
+ * not cached yet into the buffer cache. The queue is a hint: when it is
+ * full new ranges are dropped. If blocks were written around the cache or
+ * written back from it while a range was being read (bcache_wseq moved),
+ * the range is thrown away rather than risk caching stale data, and so is
+ * what is left of it when no buffer is free.
+ */
+struct prefetch_req {
+	int			block;
+	int			count;
+};
+
+static struct prefetch_req pf_queue[BIO_PREFETCH_QUEUE];
+static unsigned pf_head = 0, pf_tail = 0;
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t pf_thread;
+static int pf_running = 0;
+
+static void prefetch_run(int block_num, int count, char *data) {
+	//Trim the ends that are cached already
+	pthread_mutex_lock(&bcache_lock);
+	unsigned long wseq = bcache_wseq;
+	while (count > 0 && bcache_lookup(block_num) != NULL) {
+		block_num++;
+		count--;
+	}
+	while (count > 0 && bcache_lookup(block_num + count - 1) != NULL) {
+		count--;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	if (count == 0) {
+		return;
+	}
+
+	ssize_t n = pread(diskfile, data, (size_t) count * BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
+	if (n < BLOCK_SIZE) {
+		return;
+	}
+	count = n / BLOCK_SIZE;
+
+	//Recycling a buffer may write one back, so the check is made again after
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count && wseq == bcache_wseq; i++) {
+		int fresh;
+		struct buf *b = bcache_recycle(block_num + i, &fresh);
+		if (b == NULL) {
+			break;
+		}
+		if (fresh) {
+			if (wseq == bcache_wseq) {
+				memcpy(b->data, data + (size_t) i * BLOCK_SIZE, BLOCK_SIZE);
+				bcache_touch(b);
+			}
+			else {
+				bcache_forget(b);
+			}
+			bcache_ready(b);
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+static void *prefetch_worker(void *arg) {
+	char *data = malloc((size_t) BIO_PREFETCH_MAX * BLOCK_SIZE);
+	pthread_mutex_lock(&pf_lock);
+	while (1) {
+		while (pf_running && pf_head == pf_tail) {
+			pthread_cond_wait(&pf_cond, &pf_lock);
+		}
+		if (!pf_running) {
+			break;
+		}
+		struct prefetch_req req = pf_queue[pf_head++ % BIO_PREFETCH_QUEUE];
+		pthread_mutex_unlock(&pf_lock);
+		prefetch_run(req.block, req.count, data);
+		pthread_mutex_lock(&pf_lock);
+	}
+	pthread_mutex_unlock(&pf_lock);
+	free(data);
+	return NULL;
+}
+
+static void prefetch_start() {
+	if (pf_running) {
+		return;
+	}
+	pf_head = pf_tail = 0;
+	pf_running = 1;
+	if (pthread_create(&pf_thread, NULL, prefetch_worker, NULL) != 0) {
+		perror("prefetch thread failed, reading on demand only");
+		pf_running = 0;
+	}
+}
+
+static void prefetch_stop() {
+	pthread_mutex_lock(&pf_lock);
+	if (!pf_running) {
+		pthread_mutex_unlock(&pf_lock);
+		return;
+	}
+	pf_running = 0;
+	pthread_cond_signal(&pf_cond);
+	pthread_mutex_unlock(&pf_lock);
+	pthread_join(pf_thread, NULL);
+}
+
+//Ask for blocks [block_num, block_num + count) to be read ahead in the background
+void bio_prefetch(const int block_num, int count) {
+	if (disk_map != NULL) {
+		//The kernel pages the mapping in for us
+		off_t off = (off_t) block_num * BLOCK_SIZE;
+		off_t len = (off_t) count * BLOCK_SIZE;
+		off_t end = __atomic_load_n(&disk_len, __ATOMIC_ACQUIRE);
+		if (off < end) {
+			madvise(disk_map + off, off + len > end ? end - off : len, MADV_WILLNEED);
+		}
+		return;
+	}
+
+	//Never let one range push out more than a quarter of the cache
+	for (int block = block_num; count > 0; ) {
+		int n = count;
+		if (n > BIO_PREFETCH_MAX) {
+			n = BIO_PREFETCH_MAX;
+		}
+		if (n > BCACHE_NBUF / 4) {
+			n = BCACHE_NBUF / 4;
+		}
+		if (n <= 0) {
+			return;
+		}
+		pthread_mutex_lock(&pf_lock);
+		if (!pf_running || pf_tail - pf_head >= BIO_PREFETCH_QUEUE) {
+			pthread_mutex_unlock(&pf_lock);
+			return;
+		}
+		pf_queue[pf_tail % BIO_PREFETCH_QUEUE].block = block;
+		pf_queue[pf_tail % BIO_PREFETCH_QUEUE].count = n;
+		pf_tail++;
+		pthread_cond_signal(&pf_cond);
+		pthread_mutex_unlock(&pf_lock);
+		block += n;
+		count -= n;
+	}
+}
+
+//Select the mmap backend for the next dev_init()/dev_open()
+void dev_use_mmap(int enable) {
+	use_mmap = enable;
+}
+
+//Set the block size for the next dev_init()/dev_open(). Returns -1 if a disk
+//is open or size is not a power of two in [BLOCK_SIZE_MIN, BLOCK_SIZE_MAX].
+int dev_set_block_size(int size) {
+	if (diskfile >= 0 || size < BLOCK_SIZE_MIN || size > BLOCK_SIZE_MAX || (size & (size - 1)) != 0) {
+		return -1;
+	}
+	block_size = size;
+	return 0;
+}
+
+//Creates a file which is your new emulated disk, size bytes of zeros
+void dev_init(const char* diskfile_path, off_t size) {
     if (diskfile >= 0) {
 		return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+    diskfile = open(diskfile_path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
     if (diskfile < 0) {
 		perror("disk_open failed");
 		exit(EXIT_FAILURE);
     }
 	
-    ftruncate(diskfile, DISK_SIZE);
+    ftruncate(diskfile, size);
+	if (use_mmap) {
+		dev_map();
+	}
+	if (disk_map == NULL) {
+		bcache_init();
+		dev_start_uring();
+		prefetch_start();
+	}
 }
 
 //Function to open the disk file
@@ -48,35 +790,685 @@ int dev_open(const char* diskfile_path) {
 		perror("disk_open failed");
 		return -1;
     }
+	if (use_mmap) {
+		dev_map();
+	}
+	if (disk_map == NULL) {
+		bcache_init();
+		dev_start_uring();
+		prefetch_start();
+	}
 	return 0;
 }
 
 void dev_close() {
     if (diskfile >= 0) {
+		dev_sync();
+		if (disk_map != NULL) {
+			munmap(disk_map, BIO_MMAP_MAX);
+			disk_map = NULL;
+		}
+		prefetch_stop();
 		close(diskfile);
+		diskfile = -1;
     }
+	uring_teardown();
+	bcache_free();
+}
+
+//Write every dirty buffer back to the disk file, in block order
+int dev_flush() {
+	if (disk_map != NULL) {
+		if (msync(disk_map, disk_len, MS_ASYNC) < 0) {
+			perror("disk_msync failed");
+			return -1;
+		}
+		return 0;
+	}
+	if (bufs == NULL) {
+		return 0;
+	}
+
+	//Pin the dirty buffers so they are not recycled while being written and
+	//mark them clean up front, so a change made during the write dirties
+	//them again. Blocks awaiting a journal commit stay behind, and so do
+	//blocks pinned through bio_get(), whose holder may be changing them.
+	struct buf **dirty = malloc(BCACHE_NBUF * sizeof(struct buf *));
+	int ndirty = 0;
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < BCACHE_NBUF; i++) {
+		//A writeback already under way must land before we return
+		bcache_wait(&bufs[i]);
+	}
+	for (int i = 0; i < BCACHE_NBUF; i++) {
+		if (bufs[i].dirty && bufs[i].pins == 0 && !bcache_held(&bufs[i])) {
+			bufs[i].dirty = 0;
+			bufs[i].pins++;
+			dirty[ndirty++] = &bufs[i];
+		}
+	}
+	if (ndirty > 0) {
+		bcache_wseq++;
+	}
+	bcache_nbusy += ndirty;
+
+	//Write from a copy taken now: bio_write() may change the buffers in place
+	//once the lock is dropped
+	qsort(dirty, ndirty, sizeof(struct buf *), cmp_buf_blkno);
+	char *snap = malloc((size_t) ndirty * BLOCK_SIZE + 1);
+	for (int i = 0; i < ndirty; i++) {
+		memcpy(snap + (size_t) i * BLOCK_SIZE, dirty[i]->data, BLOCK_SIZE);
+	}
+	pthread_mutex_unlock(&bcache_lock);
+
+	//One write per run of consecutive dirty blocks, all submitted as a batch
+	struct iovec *iov = malloc((ndirty + 1) * sizeof(struct iovec));
+	struct io_req *reqs = malloc((ndirty + 1) * sizeof(struct io_req));
+	int nreq = 0;
+	for (int i = 0; i < ndirty; i++) {
+		iov[i].iov_base = snap + (size_t) i * BLOCK_SIZE;
+		iov[i].iov_len = BLOCK_SIZE;
+		if (nreq > 0 && reqs[nreq - 1].niov < BIO_MAX_IOV
+				&& dirty[i]->blkno == dirty[i - 1]->blkno + 1) {
+			reqs[nreq - 1].niov++;
+			continue;
+		}
+		reqs[nreq].write = 1;
+		reqs[nreq].off = (off_t) dirty[i]->blkno * BLOCK_SIZE;
+		reqs[nreq].iov = &iov[i];
+		reqs[nreq].niov = 1;
+		nreq++;
+	}
+
+	int retstat = dev_submit(reqs, nreq);
+	pthread_mutex_lock(&bcache_lock);
+	for (int r = 0, i = 0; r < nreq; r++) {
+		for (int k = 0; k < reqs[r].niov; k++, i++) {
+			if (reqs[r].res < 0) {
+				dirty[i]->dirty = 1;
+			}
+			dirty[i]->pins--;
+		}
+	}
+	bcache_nbusy -= ndirty;
+	pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+	if (retstat < 0) {
+		perror("block_write failed");
+	}
+	free(reqs);
+	free(iov);
+	free(snap);
+	free(dirty);
+	return retstat;
+}
+
+//Flush the cache and make the disk file durable
+int dev_sync() {
+	int retstat = 0;
+	if (disk_map != NULL) {
+		if (msync(disk_map, disk_len, MS_SYNC) < 0) {
+			perror("disk_msync failed");
+			retstat = -1;
+		}
+	}
+	else {
+		retstat = dev_flush();
+	}
+	if (diskfile >= 0 && fsync(diskfile) < 0) {
+		perror("disk_sync failed");
+		retstat = -1;
+	}
+	return retstat;
 }
 
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
+	if (disk_map != NULL) {
+		memcpy(buf, map_block(block_num), BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+
+	int fresh;
+	pthread_mutex_lock(&bcache_lock);
+	struct buf *b = bcache_alloc(block_num, &fresh);
+	if (!fresh) {
+		bcache_touch(b);
+		memcpy(buf, b->data, BLOCK_SIZE);
+		pthread_mutex_unlock(&bcache_lock);
+		return BLOCK_SIZE;
+	}
+
+	//The buffer is busy, so it is ours until bcache_ready()
+	pthread_mutex_unlock(&bcache_lock);
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
+    retstat = pread(diskfile, b->data, BLOCK_SIZE, (off_t) block_num*BLOCK_SIZE);
+	pthread_mutex_lock(&bcache_lock);
+    if (retstat < 0) {
+		perror("block_read failed");
+		memset(buf, 0, BLOCK_SIZE);
+		bcache_forget(b);
+		bcache_ready(b);
+		pthread_mutex_unlock(&bcache_lock);
+		return retstat;
     }
+	memset(b->data + retstat, 0, BLOCK_SIZE - retstat);
 
+	memcpy(buf, b->data, BLOCK_SIZE);
+	bcache_touch(b);
+	bcache_ready(b);
+	pthread_mutex_unlock(&bcache_lock);
     return retstat;
 }
 
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
-    int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-		    perror("block_write failed");
-    }
-    return retstat;
+	if (disk_map != NULL) {
+		memcpy(map_block(block_num), buf, BLOCK_SIZE);
+		return BLOCK_SIZE;
+	}
+
+	int fresh;
+	pthread_mutex_lock(&bcache_lock);
+	struct buf *b = bcache_alloc(block_num, &fresh);
+	memcpy(b->data, buf, BLOCK_SIZE);
+	b->dirty = 1;
+	bcache_log(b);
+	bcache_touch(b);
+	if (fresh) {
+		bcache_ready(b);
+	}
+	pthread_mutex_unlock(&bcache_lock);
+    return BLOCK_SIZE;
+}
+
+//Read count blocks, blocks[i] into bufs[i], merging physically contiguous
+//blocks that are not in the cache into a single read. The reads are
+//submitted together as one batch.
+int bio_readv(const int *blocks, void *const *bufs, int count) {
+	int i = 0;
+	if (disk_map != NULL) {
+		for (i = 0; i < count; i++) {
+			memcpy(bufs[i], map_block(blocks[i]), BLOCK_SIZE);
+		}
+		return count;
+	}
+
+	struct iovec *iov = malloc(count * sizeof(struct iovec));
+	struct io_req *reqs = malloc(count * sizeof(struct io_req));
+	int nreq = 0;
+	pthread_mutex_lock(&bcache_lock);
+	while (i < count) {
+		struct buf *b = bcache_find(blocks[i]);
+		if (b != NULL) {
+			bcache_touch(b);
+			memcpy(bufs[i], b->data, BLOCK_SIZE);
+			i++;
+			continue;
+		}
+
+		int n = 0;
+		do {
+			iov[i + n].iov_base = bufs[i + n];
+			iov[i + n].iov_len = BLOCK_SIZE;
+			n++;
+		} while (i + n < count && n < BIO_MAX_IOV && blocks[i + n] == blocks[i] + n
+				&& bcache_lookup(blocks[i + n]) == NULL);
+
+		reqs[nreq].write = 0;
+		reqs[nreq].off = (off_t) blocks[i] * BLOCK_SIZE;
+		reqs[nreq].iov = &iov[i];
+		reqs[nreq].niov = n;
+		nreq++;
+		i += n;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+
+	int retstat = dev_submit(reqs, nreq);
+	for (int r = 0; r < nreq; r++) {
+		if (reqs[r].res < 0) {
+			continue;
+		}
+		//Past the end of the disk file reads back as zeros
+		for (int k = reqs[r].res / BLOCK_SIZE; k < reqs[r].niov; k++) {
+			int valid = k == reqs[r].res / BLOCK_SIZE ? reqs[r].res % BLOCK_SIZE : 0;
+			memset((char *) reqs[r].iov[k].iov_base + valid, 0, BLOCK_SIZE - valid);
+		}
+	}
+	if (retstat < 0) {
+		perror("block_read failed");
+	}
+	free(reqs);
+	free(iov);
+	return retstat < 0 ? -1 : count;
+}
+
+//Write count blocks, bufs[i] to blocks[i], merging physically contiguous
+//blocks into a single write and submitting them as one batch. Cached copies
+//are refreshed and marked clean before the write goes out.
+int bio_writev(const int *blocks, const void *const *bufs, int count) {
+	int i = 0;
+	if (disk_map != NULL) {
+		for (i = 0; i < count; i++) {
+			memcpy(map_block(blocks[i]), bufs[i], BLOCK_SIZE);
+		}
+		return count;
+	}
+
+	struct iovec *iov = malloc(count * sizeof(struct iovec));
+	struct io_req *reqs = malloc(count * sizeof(struct io_req));
+	int nreq = 0;
+	while (i < count) {
+		int n = 0;
+		do {
+			iov[i + n].iov_base = (void *) bufs[i + n];
+			iov[i + n].iov_len = BLOCK_SIZE;
+			n++;
+		} while (i + n < count && n < BIO_MAX_IOV && blocks[i + n] == blocks[i] + n);
+
+		reqs[nreq].write = 1;
+		reqs[nreq].off = (off_t) blocks[i] * BLOCK_SIZE;
+		reqs[nreq].iov = &iov[i];
+		reqs[nreq].niov = n;
+		nreq++;
+		i += n;
+	}
+
+	pthread_mutex_lock(&bcache_lock);
+	for (i = 0; i < count; i++) {
+		struct buf *b = bcache_find(blocks[i]);
+		if (b != NULL) {
+			memcpy(b->data, bufs[i], BLOCK_SIZE);
+			b->dirty = 0;
+		}
+	}
+	bcache_wseq++;
+	pthread_mutex_unlock(&bcache_lock);
+
+	int retstat = dev_submit(reqs, nreq);
+	if (retstat < 0) {
+		perror("block_write failed");
+	}
+	free(reqs);
+	free(iov);
+	return retstat < 0 ? -1 : count;
+}
+
+//Make blocks [block_num, block_num + count) current in the disk file by
+//writing back any dirty cached copy, and return the disk file descriptor so
+//the caller can read them from it directly (e.g. splice them to /dev/fuse).
+//Returns -1 if the blocks must be read through bio_read() instead, because
+//a dirty one is held for the journal and may not reach the disk file yet,
+//or is pinned and may be changing.
+int bio_export(const int block_num, int count) {
+	if (disk_map != NULL) {
+		//The shared mapping and the file are one page cache
+		return diskfile;
+	}
+
+	//A block is looked at again after its writeback, which drops the lock
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count; ) {
+		struct buf *b = bcache_find(block_num + i);
+		if (b != NULL && b->dirty) {
+			if (b->pins > 0 || bcache_held(b) || bcache_writeback(b) < 0) {
+				pthread_mutex_unlock(&bcache_lock);
+				return -1;
+			}
+			continue;
+		}
+		i++;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return diskfile;
+}
+
+//Get ready for blocks [block_num, block_num + count) to be written into the
+//disk file behind the cache's back, dropping their cached copies. Returns the
+//disk file descriptor, or -1 if the blocks must go through bio_writev()
+//instead (mmap backend, or a block is pinned, busy or held for the journal).
+int bio_import(const int block_num, int count) {
+	if (disk_map != NULL) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count; i++) {
+		struct buf *b = bcache_lookup(block_num + i);
+		if (b != NULL && (b->pins > 0 || b->busy || bcache_held(b))) {
+			pthread_mutex_unlock(&bcache_lock);
+			return -1;
+		}
+	}
+	for (int i = 0; i < count; i++) {
+		struct buf *b = bcache_lookup(block_num + i);
+		if (b != NULL) {
+			bcache_forget(b);
+		}
+	}
+	bcache_wseq++;
+	pthread_mutex_unlock(&bcache_lock);
+	return diskfile;
+}
+
+/*
+ * Punch blocks [block_num, block_num + count), which the file system no
+ * longer uses, out of the disk file so that it stays sparse; they read back
+ * as zeros. Cached copies are dropped unless they are pinned, busy or held
+ * for the journal. Returns 0, or -1 if the hole could not be punched. Once the
+ * disk file turns out not to support holes, nothing is tried again.
+ */
+int bio_discard(const int block_num, int count) {
+	if (!discard_ok) {
+		return -1;
+	}
+
+	if (disk_map == NULL) {
+		//A long range is matched against the buffers, a short one looked up
+		pthread_mutex_lock(&bcache_lock);
+		int scan = count > BCACHE_NBUF;
+		for (int i = 0; i < (scan ? BCACHE_NBUF : count); i++) {
+			struct buf *b = scan ? &bufs[i] : bcache_lookup(block_num + i);
+			if (b != NULL && b->blkno >= block_num && b->blkno < block_num + count
+					&& b->pins == 0 && !b->busy && !bcache_held(b)) {
+				bcache_forget(b);
+			}
+		}
+		bcache_wseq++;
+		pthread_mutex_unlock(&bcache_lock);
+	}
+
+	if (fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t) block_num * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) < 0) {
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			fprintf(stderr, "bio_discard: the disk file cannot punch holes, not discarding\n");
+			discard_ok = 0;
+		}
+		else {
+			perror("bio_discard failed");
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Zero blocks [block_num, block_num + count) in the disk file, around the
+ * cache and the journal. The range is zeroed by the host file system when
+ * it can (fallocate ZERO_RANGE, or a punched hole), and written with zeros
+ * otherwise. Cached copies are zeroed along with it, so that no later
+ * writeback brings old contents back; they stay dirty if held for the
+ * journal. Returns 0, or -1 if the range could not be zeroed.
+ */
+int bio_zero(const int block_num, int count) {
+	off_t off = (off_t) block_num * BLOCK_SIZE;
+	off_t len = (off_t) count * BLOCK_SIZE;
+	if (disk_map == NULL) {
+		pthread_mutex_lock(&bcache_lock);
+		int scan = count > BCACHE_NBUF;
+		for (int i = 0; i < (scan ? BCACHE_NBUF : count); i++) {
+			//An old copy still being written back must not land after the zeros
+			struct buf *b = scan ? &bufs[i] : bcache_find(block_num + i);
+			if (scan) {
+				bcache_wait(b);
+			}
+			if (b != NULL && b->blkno >= block_num && b->blkno < block_num + count) {
+				memset(b->data, 0, BLOCK_SIZE);
+				if (!bcache_held(b)) {
+					b->dirty = 0;
+				}
+			}
+		}
+		bcache_wseq++;
+		pthread_mutex_unlock(&bcache_lock);
+	}
+
+	//Step 1: Let the host file system do it
+	if (zero_ok) {
+		if (fallocate(diskfile, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len) == 0) {
+			return 0;
+		}
+		if (errno == EOPNOTSUPP || errno == ENOSYS) {
+			zero_ok = 0;
+		}
+	}
+	if (discard_ok && fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0) {
+		return 0;
+	}
+
+	//Step 2: Write zeros, in place in the mapping or as one batch of
+	//requests over a shared zero buffer
+	if (disk_map != NULL) {
+		for (int i = 0; i < count; i++) {
+			memset(map_block(block_num + i), 0, BLOCK_SIZE);
+		}
+		return 0;
+	}
+	int run = count < BIO_MAX_IOV ? count : BIO_MAX_IOV;
+	char *zero = calloc(run, BLOCK_SIZE);
+	int nreq = (count + run - 1) / run;
+	struct iovec *iov = malloc(nreq * sizeof(struct iovec));
+	struct io_req *reqs = malloc(nreq * sizeof(struct io_req));
+	for (int r = 0; r < nreq; r++) {
+		int n = count - r * run < run ? count - r * run : run;
+		iov[r].iov_base = zero;
+		iov[r].iov_len = (size_t) n * BLOCK_SIZE;
+		reqs[r].write = 1;
+		reqs[r].off = off + (off_t) r * run * BLOCK_SIZE;
+		reqs[r].iov = &iov[r];
+		reqs[r].niov = 1;
+	}
+	int retstat = dev_submit(reqs, nreq);
+	if (retstat < 0) {
+		perror("bio_zero failed");
+	}
+	free(reqs);
+	free(iov);
+	free(zero);
+	return retstat < 0 ? -1 : 0;
+}
+
+/*
+ * Get a pointer to a block's contents without copying it. With the mmap
+ * backend this points into the mapping; otherwise the block is loaded into
+ * the buffer cache and pinned there. Every bio_get() needs a bio_put(),
+ * passing dirty if the block was modified through the pointer.
+ */
+void *bio_get(const int block_num) {
+	if (disk_map != NULL) {
+		return map_block(block_num);
+	}
+
+	int fresh;
+	pthread_mutex_lock(&bcache_lock);
+	struct buf *b = bcache_alloc(block_num, &fresh);
+	bcache_touch(b);
+	b->pins++;
+	if (fresh) {
+		//Read it in with the lock dropped, lookups wait on the busy buffer
+		pthread_mutex_unlock(&bcache_lock);
+		ssize_t retstat = pread(diskfile, b->data, BLOCK_SIZE, (off_t) block_num * BLOCK_SIZE);
+		if (retstat < BLOCK_SIZE) {
+			if (retstat < 0) {
+				perror("block_read failed");
+				retstat = 0;
+			}
+			memset(b->data + retstat, 0, BLOCK_SIZE - retstat);
+		}
+		pthread_mutex_lock(&bcache_lock);
+		bcache_ready(b);
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	return b->data;
+}
+
+void bio_put(const int block_num, int dirty) {
+	if (disk_map != NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&bcache_lock);
+	struct buf *b = bcache_lookup(block_num);
+	if (b != NULL) {
+		b->pins--;
+		if (dirty) {
+			b->dirty = 1;
+			bcache_log(b);
+		}
+		if (b->pins == 0 && bcache_nwait > 0) {
+			pthread_cond_broadcast(&bcache_cond);
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+/*
+ * Journal support
+ *
+ * The journal (journal.c) decides what a transaction is; the cache only
+ * tags the blocks changed while transaction log_seq is open and keeps them
+ * from reaching their home location until bio_log_commit() says it is safe.
+ * Journal records and checkpoints are written around the cache with
+ * dev_writev().
+ */
+
+//Start tagging changed blocks with transaction seq. Returns -1 if the
+//backend cannot hold blocks back (mmap), or the cache is too small to hold
+//a whole transaction next to the blocks pinned by running operations.
+int bio_log_start(unsigned seq) {
+	if (disk_map != NULL || bufs == NULL || BCACHE_NBUF < 64) {
+		return -1;
+	}
+	pthread_mutex_lock(&bcache_lock);
+	log_seq = seq;
+	log_done = seq - 1;
+	log_count = 0;
+	log_failed = 0;
+	pthread_mutex_unlock(&bcache_lock);
+	return 0;
+}
+
+void bio_log_stop() {
+	pthread_mutex_lock(&bcache_lock);
+	log_seq = 0;
+	log_done = 0;
+	log_count = 0;
+	for (int i = 0; bufs != NULL && i < BCACHE_NBUF; i++) {
+		bufs[i].jseq = 0;
+	}
+	pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+//Number of blocks changed in the transaction in progress
+int bio_log_count() {
+	return __atomic_load_n(&log_count, __ATOMIC_RELAXED);
+}
+
+//Close the transaction in progress: copy out every block it changed, sorted
+//by block number, and open the next one. The blocks stay held until
+//bio_log_commit(). Returns the number of blocks, *blocks and *data being
+//malloc'd (NULL when there are none).
+int bio_log_collect(int **blocks, char **data) {
+	pthread_mutex_lock(&bcache_lock);
+	int count = 0;
+	struct buf **logged = malloc((log_count + 1) * sizeof(struct buf *));
+	for (int i = 0; i < BCACHE_NBUF && count < log_count; i++) {
+		if (bufs[i].jseq == log_seq) {
+			logged[count++] = &bufs[i];
+		}
+	}
+	qsort(logged, count, sizeof(struct buf *), cmp_buf_blkno);
+
+	*blocks = NULL;
+	*data = NULL;
+	if (count > 0) {
+		*blocks = malloc(count * sizeof(int));
+		*data = malloc((size_t) count * BLOCK_SIZE);
+		for (int i = 0; i < count; i++) {
+			(*blocks)[i] = logged[i]->blkno;
+			memcpy(*data + (size_t) i * BLOCK_SIZE, logged[i]->data, BLOCK_SIZE);
+		}
+		log_seq++;
+		log_count = 0;
+	}
+	pthread_mutex_unlock(&bcache_lock);
+	free(logged);
+	return count;
+}
+
+//Transaction seq (and every one before it) is safely in the journal, so the
+//blocks it changed may be written back
+void bio_log_commit(unsigned seq) {
+	pthread_mutex_lock(&bcache_lock);
+	log_done = seq;
+	pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+//A commit failed: the blocks held for it and after it will never be
+//written back, so their buffers may be recycled
+void bio_log_fail() {
+	pthread_mutex_lock(&bcache_lock);
+	log_failed = 1;
+	pthread_cond_broadcast(&bcache_cond);
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+//Blocks whose contents as of transaction seq have been written to their
+//home location by a checkpoint are clean, unless changed again since
+void bio_log_clean(const int *blocks, int count, unsigned seq) {
+	pthread_mutex_lock(&bcache_lock);
+	for (int i = 0; i < count; i++) {
+		struct buf *b = bcache_lookup(blocks[i]);
+		if (b != NULL && b->dirty && b->pins == 0 && (int) (b->jseq - seq) <= 0) {
+			b->dirty = 0;
+		}
+	}
+	pthread_mutex_unlock(&bcache_lock);
+}
+
+//Write count blocks straight to the disk file without touching the cache,
+//merging contiguous blocks and submitting them as one batch
+int dev_writev(const int *blocks, const void *const *bufs, int count) {
+	struct iovec *iov = malloc(count * sizeof(struct iovec));
+	struct io_req *reqs = malloc(count * sizeof(struct io_req));
+	int nreq = 0;
+	for (int i = 0; i < count; ) {
+		int n = 0;
+		do {
+			iov[i + n].iov_base = (void *) bufs[i + n];
+			iov[i + n].iov_len = BLOCK_SIZE;
+			n++;
+		} while (i + n < count && n < BIO_MAX_IOV && blocks[i + n] == blocks[i] + n);
+
+		reqs[nreq].write = 1;
+		reqs[nreq].off = (off_t) blocks[i] * BLOCK_SIZE;
+		reqs[nreq].iov = &iov[i];
+		reqs[nreq].niov = n;
+		nreq++;
+		i += n;
+	}
+
+	pthread_mutex_lock(&bcache_lock);
+	bcache_wseq++;
+	pthread_mutex_unlock(&bcache_lock);
+
+	int retstat = dev_submit(reqs, nreq);
+	if (retstat < 0) {
+		perror("block_write failed");
+	}
+	free(reqs);
+	free(iov);
+	return retstat < 0 ? -1 : count;
+}
+
+//Make what was written to the disk file so far durable, without flushing the cache
+int dev_barrier() {
+	if (diskfile >= 0 && fdatasync(diskfile) < 0) {
+		perror("disk_sync failed");
+		return -1;
+	}
+	return 0;
 }
 
@@ -8,12 +8,63 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 4096
+#include <sys/types.h>
 
-void dev_init(const char* diskfile_path);
+//Block size of the disk, chosen at mkfs and set with dev_set_block_size()
+//before the disk is opened
+extern int block_size;
+#define BLOCK_SIZE block_size
+#define BLOCK_SIZE_MIN 4096
+#define BLOCK_SIZE_MAX 65536
+
+//Buffer cache geometry: number of cached blocks and hash buckets
+#ifndef BCACHE_NBUF
+#define BCACHE_NBUF 1024
+#endif
+#ifndef BCACHE_NHASH
+#define BCACHE_NHASH 2039
+#endif
+
+//Virtual address space reserved for the mmap backend, bounds the disk size
+#define BIO_MMAP_MAX (16LL*1024*1024*1024)
+
+//Most blocks merged into one preadv/pwritev by bio_readv/bio_writev
+#define BIO_MAX_IOV 256
+
+//Submission queue depth of the io_uring backend
+#define BIO_URING_DEPTH 64
+
+//Pending readahead ranges, and the most blocks the prefetcher reads at once
+#define BIO_PREFETCH_QUEUE 64
+#define BIO_PREFETCH_MAX 256
+
+void dev_use_mmap(int enable);
+void dev_use_uring(int enable);
+int dev_set_block_size(int size);
+void dev_init(const char* diskfile_path, off_t size);
 int dev_open(const char* diskfile_path);
 void dev_close();
+int dev_flush();
+int dev_sync();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int *blocks, void *const *bufs, int count);
+int bio_writev(const int *blocks, const void *const *bufs, int count);
+void *bio_get(const int block_num);
+void bio_put(const int block_num, int dirty);
+int bio_export(const int block_num, int count);
+int bio_import(const int block_num, int count);
+int bio_discard(const int block_num, int count);
+int bio_zero(const int block_num, int count);
+void bio_prefetch(const int block_num, int count);
+int bio_log_start(unsigned seq);
+void bio_log_stop();
+int bio_log_count();
+int bio_log_collect(int **blocks, char **data);
+void bio_log_commit(unsigned seq);
+void bio_log_fail();
+void bio_log_clean(const int *blocks, int count, unsigned seq);
+int dev_writev(const int *blocks, const void *const *bufs, int count);
+int dev_barrier();
 
 #endif
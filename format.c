@@ -0,0 +1,170 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	format.c
+ *
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "journal.h"
+#include "rufs.h"
+
+_Static_assert(sizeof(struct superblock) <= BLOCK_SIZE_MIN, "the superblock must fit in the smallest block");
+
+/*
+ * Lay out a new file system
+ *
+ * Block 0 holds the superblock, followed by the inode bitmap, the data block
+ * bitmap and the journal; the data region starts with the first inode table
+ * chunk and the root directory. The data block bitmap covers the whole disk,
+ * so the metadata blocks are simply marked in use. Fields of geo left 0 are
+ * set to what was picked for them.
+ */
+int rufs_format(const char *path, struct rufs_geometry *geo) {
+
+	// Step 1: Check the geometry and work out where everything goes
+	if(dev_set_block_size(geo->block_size) < 0){
+		fprintf(stderr, "rufs: block size must be a power of two from %d to %d\n", BLOCK_SIZE_MIN, BLOCK_SIZE_MAX);
+		return -1;
+	}
+	uint32_t isize = geo->inode_size != 0 ? geo->inode_size : INODE_SIZE_DEFAULT;
+	if(isize < INODE_SIZE_MIN || isize > INODE_SIZE_MAX || (isize & (isize - 1)) != 0){
+		fprintf(stderr, "rufs: inode size must be a power of two from %d to %d\n", INODE_SIZE_MIN, INODE_SIZE_MAX);
+		return -1;
+	}
+	off_t nblocks = geo->disk_size / BLOCK_SIZE;
+	if(nblocks > INT32_MAX || geo->max_inum > INT32_MAX){
+		fprintf(stderr, "rufs: disk size or inode count out of range\n");
+		return -1;
+	}
+
+	// Inode table chunks are at least a block and a bitmap word, and large
+	// enough that INODE_CHUNKS_MAX of them reach max_inum
+	uint64_t max_inum = geo->max_inum != 0 ? geo->max_inum : (uint64_t) nblocks;
+	uint32_t align = BLOCK_SIZE / isize > 64 ? BLOCK_SIZE / isize : 64;
+	uint32_t chunk = (max_inum + INODE_CHUNKS_MAX - 1) / INODE_CHUNKS_MAX;
+	if(chunk < INODE_CHUNK_MIN){
+		chunk = INODE_CHUNK_MIN;
+	}
+	chunk = (chunk + align - 1) / align * align;
+	max_inum = (max_inum + chunk - 1) / chunk * chunk;
+	if(max_inum > INT32_MAX){
+		max_inum -= chunk;
+	}
+	uint32_t chunk_blocks = (size_t) chunk * isize / BLOCK_SIZE;
+
+	struct superblock *sb = calloc(1, BLOCK_SIZE);
+	sb->magic_num = MAGIC_NUM;
+	sb->block_size = BLOCK_SIZE;
+	sb->max_inum = max_inum;
+	sb->max_dnum = nblocks;
+	sb->inode_size = isize;
+	sb->i_chunk_inodes = chunk;
+	sb->i_bitmap_blk = 1;
+	sb->d_bitmap_blk = sb->i_bitmap_blk + BITMAP_BLOCKS(sb->max_inum);
+	sb->j_start_blk = sb->d_bitmap_blk + BITMAP_BLOCKS(sb->max_dnum);
+	sb->j_blocks = geo->j_blocks;
+	sb->d_start_blk = sb->j_start_blk + sb->j_blocks;
+	sb->i_chunk_blk[0] = sb->d_start_blk;
+	if(sb->j_blocks < 4 || (off_t) (sb->d_start_blk + chunk_blocks) >= nblocks){
+		fprintf(stderr, "rufs: %lld blocks cannot hold %u inodes and a %u block journal\n",
+			(long long) nblocks, chunk, sb->j_blocks);
+		free(sb);
+		return -1;
+	}
+
+	// Allocation groups cover at most one bitmap block, but a small disk
+	// still gets about 16 of them so that unrelated files can be kept apart.
+	// Group bitmaps start on a 64-bit word so they can be scanned by word,
+	// and each group's inodes are whole table chunks.
+	uint32_t group_blocks = geo->group_blocks;
+	if(group_blocks == 0){
+		group_blocks = nblocks / 16;
+		if(group_blocks > (uint32_t) (8 * BLOCK_SIZE)){
+			group_blocks = 8 * BLOCK_SIZE;
+		}
+		if(group_blocks < 1024){
+			group_blocks = 1024;
+		}
+	}
+	sb->group_blocks = (group_blocks + 63) & ~63;
+	uint32_t ngroups = (sb->max_dnum + sb->group_blocks - 1) / sb->group_blocks;
+	sb->group_inodes = ((sb->max_inum + ngroups - 1) / ngroups + chunk - 1) / chunk * chunk;
+
+	// Step 2: Create the disk file, every block reads as zeros
+	dev_init(path, nblocks * BLOCK_SIZE);
+	bio_write(0, sb);
+
+	// Step 3: Only the first inode table chunk exists, and its inode 0 is
+	// the root. Blocks up to and including the root directory's are in use
+	bitmap_t bmap = malloc((size_t) BITMAP_BLOCKS(sb->max_inum) * BLOCK_SIZE);
+	memset(bmap, 0xFF, (size_t) BITMAP_BLOCKS(sb->max_inum) * BLOCK_SIZE);
+	for(uint32_t ino = 1; ino < chunk; ino++){
+		unset_bitmap(bmap, ino);
+	}
+	for(uint32_t k = 0; k < BITMAP_BLOCKS(sb->max_inum); k++){
+		bio_write(sb->i_bitmap_blk + k, bmap + (size_t) k * BLOCK_SIZE);
+	}
+	free(bmap);
+	bmap = calloc(BITMAP_BLOCKS(sb->max_dnum), BLOCK_SIZE);
+	for(uint32_t blk = 0; blk <= sb->d_start_blk + chunk_blocks; blk++){
+		set_bitmap(bmap, blk);
+	}
+	for(uint32_t k = 0; k < BITMAP_BLOCKS(sb->max_dnum); k++){
+		bio_write(sb->d_bitmap_blk + k, bmap + (size_t) k * BLOCK_SIZE);
+	}
+	free(bmap);
+
+	// Step 4: Root directory inode, with its one block
+	struct dinode *root = calloc(1, BLOCK_SIZE);
+	root->version = DINODE_VERSION;
+	root->mode = S_IFDIR | 0755;
+	root->links = 2;
+	root->uid = getuid();
+	root->gid = getgid();
+	root->blocks = 1;
+	root->size = DIRENT_LEN(1) + DIRENT_LEN(2);
+	root->atime = root->mtime = root->ctime = time(NULL);
+	struct extent_header *hdr = (struct extent_header *) root->i_block;
+	struct extent *ext = (struct extent *) (hdr + 1);
+	hdr->count = 1;
+	ext->lblk = 0;
+	ext->pblk = sb->d_start_blk + chunk_blocks;
+	ext->len = 1;
+	bio_write(sb->i_chunk_blk[0], root);
+	free(root);
+
+	// Step 5: "." and ".." both lead back to the root
+	char *root_dir = calloc(1, BLOCK_SIZE);
+	struct dirent *dot = (struct dirent *) root_dir;
+	dot->ino = 0;
+	dot->type = FT_DIR;
+	dot->name_len = 1;
+	memcpy(dot->name, ".", 1);
+	dot->rec_len = DIRENT_LEN(dot->name_len);
+	struct dirent *dotdot = (struct dirent *) (root_dir + dot->rec_len);
+	dotdot->ino = 0;
+	dotdot->type = FT_DIR;
+	dotdot->name_len = 2;
+	memcpy(dotdot->name, "..", 2);
+	dotdot->rec_len = BLOCK_SIZE - dot->rec_len;
+	bio_write(sb->d_start_blk + chunk_blocks, root_dir);
+	free(root_dir);
+
+	// Step 6: Empty journal, then make it all durable
+	dev_sync();
+	journal_format(sb->j_start_blk, sb->j_blocks);
+	geo->max_inum = sb->max_inum;
+	geo->group_blocks = sb->group_blocks;
+	geo->inode_size = isize;
+	free(sb);
+	dev_close();
+	return 0;
+}
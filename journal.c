@@ -0,0 +1,861 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	journal.c
+ *
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "journal.h"
+
+/*
+ * Metadata journal
+ *
+ * Every metadata operation runs between journal_start() and journal_stop().
+ * The blocks it changes are tagged in the buffer cache with the running
+ * transaction and held there. Operations are not committed one by one:
+ * a commit waits for the operations in flight to finish, lets the file
+ * system push its in-memory metadata into the cache (prepare), closes the
+ * running transaction and writes every block it changed to the log with
+ * one sequential write. Any number of operations, from any number of
+ * threads, share that write. Commits happen when the commit thread's
+ * timer expires, when fsync() asks for one, or when a transaction grows
+ * past j_txn_max blocks.
+ *
+ * A committed transaction's block copies stay in memory until a checkpoint
+ * writes the newest copy of each block to its home location and frees the
+ * log up to the head. That happens in the background once the log is half
+ * full, or in the committer's way when the next commit does not fit. At
+ * mount, committed transactions still in the log are replayed.
+ *
+ * A block that is freed and may be reused as file data is revoked: its
+ * copies in earlier transactions are neither checkpointed nor replayed,
+ * since they would overwrite data that is never logged.
+ *
+ * If a commit cannot be written, its blocks stay held in the cache for
+ * good and the journal fails: every later journal_start(), journal_stop()
+ * and journal_commit() reports it, and nothing more is logged.
+ *
+ * j_lock guards the handle count, the barrier, the commit counters and the
+ * blocks revoked by the running transaction. Only the thread that set
+ * j_committing touches the log positions and the list of committed
+ * transactions.
+ */
+struct jtxn {
+	uint32_t	seq;
+	int			count;
+	int			*blocks;		/* home block numbers, sorted */
+	char		*data;			/* copies of those blocks, as committed */
+	int			nrevoke;
+	int			*revoke;		/* blocks freed by the transaction */
+	struct jtxn	*next;
+};
+
+//A revoked block and the last transaction that revoked it
+struct jrevoked {
+	int			blk;
+	uint32_t	seq;
+};
+
+static int j_active = 0;
+static int j_start;				/* journal super block */
+static uint32_t j_len;			/* blocks in the circular log */
+static uint32_t j_head, j_tail;	/* log positions: next free block, oldest live one */
+static uint32_t j_seq;			/* sequence number of the running transaction */
+static uint32_t j_tail_seq;		/* sequence number of the transaction at j_tail */
+static int j_txn_max;			/* blocks a transaction may grow to before it is committed */
+static struct jtxn *j_done = NULL, **j_done_end = &j_done;	/* committed, not checkpointed */
+static void (*j_prepare)(void) = NULL;
+static void (*j_committed)(int ok) = NULL;
+
+static pthread_mutex_t j_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t j_cond = PTHREAD_COND_INITIALIZER;
+static int j_handles = 0;		/* operations in flight */
+static int j_barrier = 0;		/* a commit is waiting for them, hold new ones back */
+static int j_committing = 0;	/* a commit or checkpoint owns the log */
+static int j_error = 0;			/* a commit failed, nothing more is logged */
+static unsigned j_started = 0, j_finished = 0;	/* commits begun and done */
+static __thread int j_depth = 0;	/* journal_start() nesting in this thread */
+static int *j_revoke = NULL;	/* blocks revoked by the running transaction */
+static int j_nrevoke = 0, j_revoke_cap = 0;
+static int j_revoke_wait = 0;	/* a checkpoint is writing, hold new revokes back */
+
+static pthread_cond_t j_kick = PTHREAD_COND_INITIALIZER;
+static pthread_t j_thread;
+static int j_thread_running = 0;
+static int j_kicked = 0;
+
+#define JSUM_INIT 0xcbf29ce484222325ULL
+
+//FNV-1a, a 64-bit word at a time
+static uint64_t jsum(uint64_t h, const void *data) {
+	const uint64_t *w = data;
+	for (size_t i = 0; i < BLOCK_SIZE / sizeof(uint64_t); i++) {
+		h ^= w[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static inline int jblock(uint32_t pos) {
+	return j_start + 1 + pos % j_len;
+}
+
+static inline uint32_t journal_used() {
+	return (j_head + j_len - j_tail) % j_len;
+}
+
+static int journal_write_super() {
+	struct jsuper *js = calloc(1, BLOCK_SIZE);
+	js->magic = JOURNAL_MAGIC;
+	js->blocks = j_len + 1;
+	js->tail = j_tail;
+	js->tail_seq = j_tail_seq;
+	int blk = j_start;
+	const void *buf = js;
+	int retstat = dev_writev(&blk, &buf, 1);
+	free(js);
+	if (retstat < 0 || dev_barrier() < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+//Read log blocks pos.. into bufs, around the cache
+static int journal_read(uint32_t pos, char *data, int count) {
+	int *blocks = malloc(count * sizeof(int));
+	void **bufs = malloc(count * sizeof(void *));
+	for (int i = 0; i < count; i++) {
+		blocks[i] = jblock(pos + i);
+		bufs[i] = data + (size_t) i * BLOCK_SIZE;
+	}
+	int retstat = bio_readv(blocks, bufs, count);
+	free(bufs);
+	free(blocks);
+	return retstat;
+}
+
+static int cmp_jrevoked(const void *a, const void *b) {
+	const struct jrevoked *x = a, *y = b;
+	if (x->blk != y->blk) {
+		return x->blk < y->blk ? -1 : 1;
+	}
+	return (int) (x->seq - y->seq);
+}
+
+//Add the blocks revoked by transaction seq to the table *tbl of *n entries
+static void jrevoked_add(struct jrevoked **tbl, int *n, const int *blocks, int count, uint32_t seq) {
+	*tbl = realloc(*tbl, (*n + count) * sizeof(struct jrevoked));
+	for (int i = 0; i < count; i++) {
+		(*tbl)[*n + i].blk = blocks[i];
+		(*tbl)[*n + i].seq = seq;
+	}
+	*n += count;
+}
+
+//Sort the table by block, keeping only the last revoke of each
+static int jrevoked_sort(struct jrevoked *tbl, int n) {
+	qsort(tbl, n, sizeof(struct jrevoked), cmp_jrevoked);
+	int m = 0;
+	for (int i = 0; i < n; i++) {
+		if (m > 0 && tbl[m - 1].blk == tbl[i].blk) {
+			m--;
+		}
+		tbl[m++] = tbl[i];
+	}
+	return m;
+}
+
+//Whether the copy of blk logged by transaction seq was revoked since
+static int jrevoked_has(const struct jrevoked *tbl, int n, int blk, uint32_t seq) {
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (tbl[mid].blk < blk) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo < n && tbl[lo].blk == blk && (int) (tbl[lo].seq - seq) >= 0;
+}
+
+/*
+ * Write every committed transaction still in memory to its home blocks,
+ * newest copy of each block only, and empty the log. Copies revoked since
+ * they were logged, by a committed transaction, by pending (about to be
+ * logged, may be NULL) or by the running one, are left out. Blocks freed
+ * now may already hold file data, so new revokes wait until the copies
+ * are home. Called by the owner of j_committing.
+ */
+static void journal_checkpoint(const struct jtxn *pending) {
+	if (j_done == NULL) {
+		return;
+	}
+
+	//Step 0: Which copies have been revoked since they were logged
+	struct jrevoked *revoked = NULL;
+	int nrevoked = 0;
+	for (struct jtxn *t = j_done; t != NULL; t = t->next) {
+		jrevoked_add(&revoked, &nrevoked, t->revoke, t->nrevoke, t->seq);
+	}
+	if (pending != NULL) {
+		jrevoked_add(&revoked, &nrevoked, pending->revoke, pending->nrevoke, pending->seq);
+	}
+	pthread_mutex_lock(&j_lock);
+	jrevoked_add(&revoked, &nrevoked, j_revoke, j_nrevoke, j_seq);
+	j_revoke_wait = 1;
+	pthread_mutex_unlock(&j_lock);
+	nrevoked = jrevoked_sort(revoked, nrevoked);
+
+	//Step 1: Merge the transactions' sorted block lists oldest first, a
+	//later copy of a block replacing an earlier one
+	int total = 0;
+	uint32_t last_seq = 0;
+	for (struct jtxn *t = j_done; t != NULL; t = t->next) {
+		total += t->count;
+		last_seq = t->seq;
+	}
+	int *blocks = malloc(total * sizeof(int));
+	const void **bufs = malloc(total * sizeof(void *));
+	int n = 0;
+	for (struct jtxn *t = j_done; t != NULL; t = t->next) {
+		int *mblocks = malloc((n + t->count) * sizeof(int));
+		const void **mbufs = malloc((n + t->count) * sizeof(void *));
+		int i = 0, k = 0, m = 0;
+		while (i < n || k < t->count) {
+			if (k == t->count || (i < n && blocks[i] < t->blocks[k])) {
+				mblocks[m] = blocks[i];
+				mbufs[m++] = bufs[i++];
+			}
+			else {
+				if (i < n && blocks[i] == t->blocks[k]) {
+					i++;
+				}
+				if (!jrevoked_has(revoked, nrevoked, t->blocks[k], t->seq)) {
+					mblocks[m] = t->blocks[k];
+					mbufs[m++] = t->data + (size_t) k * BLOCK_SIZE;
+				}
+				k++;
+			}
+		}
+		memcpy(blocks, mblocks, m * sizeof(int));
+		memcpy(bufs, mbufs, m * sizeof(void *));
+		n = m;
+		free(mbufs);
+		free(mblocks);
+	}
+	free(revoked);
+
+	//Step 2: Write them home and make that durable before the log forgets them
+	int retstat = dev_writev(blocks, bufs, n);
+	if (retstat >= 0) {
+		retstat = dev_barrier();
+	}
+	pthread_mutex_lock(&j_lock);
+	j_revoke_wait = 0;
+	pthread_cond_broadcast(&j_cond);
+	pthread_mutex_unlock(&j_lock);
+	if (retstat < 0) {
+		fprintf(stderr, "journal: checkpoint failed, keeping the log\n");
+		free(bufs);
+		free(blocks);
+		return;
+	}
+	bio_log_clean(blocks, n, last_seq);
+	free(bufs);
+	free(blocks);
+
+	//Step 3: Everything logged so far is home, the log starts over at its head
+	//with the pending transaction, if any, as its first entry
+	j_tail = j_head;
+	j_tail_seq = pending != NULL ? pending->seq : j_seq;
+	journal_write_super();
+	while (j_done != NULL) {
+		struct jtxn *t = j_done;
+		j_done = t->next;
+		free(t->blocks);
+		free(t->data);
+		free(t->revoke);
+		free(t);
+	}
+	j_done_end = &j_done;
+}
+
+//Log transaction t and keep it for the checkpoint, which then owns it.
+//Called by the owner of j_committing.
+static int journal_write(struct jtxn *t) {
+	int count = t->count;
+	int ndesc = (count + JDESC_MAX - 1) / JDESC_MAX;
+	int nrdesc = (t->nrevoke + JDESC_MAX - 1) / JDESC_MAX;
+	uint32_t need = count + ndesc + nrdesc + 1;
+	if (need > j_len - 1 - journal_used()) {
+		journal_checkpoint(t);
+	}
+
+	if (need > j_len - 1 - journal_used()) {
+		//Bigger than the whole log: it can only go home unprotected
+		fprintf(stderr, "journal: transaction of %d blocks does not fit, writing it in place\n", count);
+		const void **bufs = malloc(count * sizeof(void *));
+		for (int i = 0; i < count; i++) {
+			bufs[i] = t->data + (size_t) i * BLOCK_SIZE;
+		}
+		int retstat = dev_writev(t->blocks, bufs, count);
+		if (retstat >= 0) {
+			retstat = dev_barrier();
+		}
+		free(bufs);
+		if (retstat >= 0) {
+			bio_log_commit(t->seq);
+			j_tail = j_head;
+			j_tail_seq = t->seq + 1;
+			journal_write_super();
+		}
+		else {
+			fprintf(stderr, "journal: in-place write of transaction %u failed\n", t->seq);
+		}
+		free(t->blocks);
+		free(t->data);
+		free(t->revoke);
+		free(t);
+		return retstat < 0 ? -1 : 0;
+	}
+
+	//Step 1: Descriptors, block copies, revoke blocks and the commit block,
+	//in log order
+	int *jblocks = malloc(need * sizeof(int));
+	const void **jbufs = malloc(need * sizeof(void *));
+	char *descs = calloc(ndesc + nrdesc + 1, BLOCK_SIZE);
+	struct jcommit *commit = (struct jcommit *) (descs + (size_t) (ndesc + nrdesc) * BLOCK_SIZE);
+	uint64_t sum = JSUM_INIT;
+	uint32_t pos = j_head;
+	int n = 0;
+	for (int d = 0; d < ndesc; d++) {
+		struct jdesc *desc = (struct jdesc *) (descs + (size_t) d * BLOCK_SIZE);
+		int first = d * JDESC_MAX;
+		desc->magic = JDESC_MAGIC;
+		desc->seq = t->seq;
+		desc->count = count - first < (int) JDESC_MAX ? count - first : (int) JDESC_MAX;
+		desc->more = d < ndesc - 1;
+		for (uint32_t i = 0; i < desc->count; i++) {
+			desc->home[i] = t->blocks[first + i];
+		}
+		sum = jsum(sum, desc);
+		jblocks[n] = jblock(pos++);
+		jbufs[n++] = desc;
+		for (uint32_t i = 0; i < desc->count; i++) {
+			const char *copy = t->data + (size_t) (first + i) * BLOCK_SIZE;
+			sum = jsum(sum, copy);
+			jblocks[n] = jblock(pos++);
+			jbufs[n++] = copy;
+		}
+	}
+	for (int d = 0; d < nrdesc; d++) {
+		struct jdesc *rev = (struct jdesc *) (descs + (size_t) (ndesc + d) * BLOCK_SIZE);
+		int first = d * JDESC_MAX;
+		rev->magic = JREVOKE_MAGIC;
+		rev->seq = t->seq;
+		rev->count = t->nrevoke - first < (int) JDESC_MAX ? t->nrevoke - first : (int) JDESC_MAX;
+		rev->more = d < nrdesc - 1;
+		memcpy(rev->home, t->revoke + first, rev->count * sizeof(uint32_t));
+		sum = jsum(sum, rev);
+		jblocks[n] = jblock(pos++);
+		jbufs[n++] = rev;
+	}
+	commit->magic = JCOMMIT_MAGIC;
+	commit->seq = t->seq;
+	commit->count = count;
+	commit->revoked = t->nrevoke;
+	commit->checksum = sum;
+	jblocks[n] = jblock(pos++);
+	jbufs[n++] = commit;
+
+	//Step 2: One sequential write (two if it wraps), durable before the
+	//blocks may go home
+	int retstat = dev_writev(jblocks, jbufs, n);
+	if (retstat >= 0) {
+		retstat = dev_barrier();
+	}
+	free(descs);
+	free(jbufs);
+	free(jblocks);
+	if (retstat < 0) {
+		//Its blocks stay held, so none of them reaches its home location
+		fprintf(stderr, "journal: commit of transaction %u failed, no more metadata is logged\n", t->seq);
+		free(t->blocks);
+		free(t->data);
+		free(t->revoke);
+		free(t);
+		return -1;
+	}
+	j_head = pos % j_len;
+	bio_log_commit(t->seq);
+
+	t->next = NULL;
+	*j_done_end = t;
+	j_done_end = &t->next;
+	return 0;
+}
+
+/*
+ * Commit the running transaction. Called with j_lock held and no commit in
+ * progress; j_lock is dropped while the log is written and held again on
+ * return.
+ */
+static void journal_do_commit() {
+	j_committing = 1;
+	j_started++;
+
+	//Step 1: Let the operations in flight finish and keep new ones out
+	j_barrier = 1;
+	while (j_handles > 0) {
+		pthread_cond_wait(&j_cond, &j_lock);
+	}
+	struct jtxn *t = calloc(1, sizeof(struct jtxn));
+	t->revoke = j_revoke;
+	t->nrevoke = j_nrevoke;
+	j_revoke = NULL;
+	j_nrevoke = j_revoke_cap = 0;
+	pthread_mutex_unlock(&j_lock);
+
+	//Step 2: Bring the cache up to date and close the transaction
+	if (j_prepare != NULL) {
+		j_prepare();
+	}
+	t->count = bio_log_collect(&t->blocks, &t->data);
+	t->seq = j_seq;
+	int count = t->count;
+	if (count > 0) {
+		j_seq++;
+	}
+	else {
+		//Nothing to log; any revokes stay with the running transaction
+		pthread_mutex_lock(&j_lock);
+		for (int i = 0; i < t->nrevoke; i++) {
+			if (j_nrevoke == j_revoke_cap) {
+				j_revoke_cap = j_revoke_cap > 0 ? 2 * j_revoke_cap : 64;
+				j_revoke = realloc(j_revoke, j_revoke_cap * sizeof(int));
+			}
+			j_revoke[j_nrevoke++] = t->revoke[i];
+		}
+		pthread_mutex_unlock(&j_lock);
+		free(t->revoke);
+		free(t);
+	}
+
+	//Step 3: New operations go into the next transaction while this one is logged
+	pthread_mutex_lock(&j_lock);
+	j_barrier = 0;
+	pthread_cond_broadcast(&j_cond);
+	pthread_mutex_unlock(&j_lock);
+
+	int retstat = count > 0 ? journal_write(t) : 0;
+	if (j_committed != NULL) {
+		j_committed(retstat == 0);
+	}
+	if (retstat < 0) {
+		bio_log_fail();
+	}
+
+	pthread_mutex_lock(&j_lock);
+	if (retstat < 0) {
+		j_error = 1;
+	}
+	j_committing = 0;
+	j_finished++;
+	pthread_cond_broadcast(&j_cond);
+	if (journal_used() > j_len / 2) {
+		//Leave the checkpoint to the commit thread
+		j_kicked = 1;
+		pthread_cond_signal(&j_kick);
+	}
+}
+
+static void *journal_worker(void *arg) {
+	pthread_mutex_lock(&j_lock);
+	while (j_thread_running) {
+		if (!j_kicked) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += JOURNAL_COMMIT_MS / 1000;
+			ts.tv_nsec += (JOURNAL_COMMIT_MS % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&j_kick, &j_lock, &ts);
+		}
+		j_kicked = 0;
+		if (!j_thread_running || j_committing || j_error) {
+			continue;
+		}
+		if (bio_log_count() > 0) {
+			journal_do_commit();
+		}
+		if (!j_committing && journal_used() > j_len / 2) {
+			j_committing = 1;
+			pthread_mutex_unlock(&j_lock);
+			journal_checkpoint(NULL);
+			pthread_mutex_lock(&j_lock);
+			j_committing = 0;
+			pthread_cond_broadcast(&j_cond);
+		}
+	}
+	pthread_mutex_unlock(&j_lock);
+	return NULL;
+}
+
+/*
+ * Read transaction seq from log position pos into t: its descriptors and
+ * block copies, its revoke blocks and its commit block. Returns the log
+ * position after it, or -1 if it is not there, incomplete or damaged.
+ */
+static int64_t journal_read_txn(uint32_t pos, uint32_t seq, struct jtxn *t) {
+	char *desc = malloc(BLOCK_SIZE);
+	struct jdesc *d = (struct jdesc *) desc;
+	uint64_t sum = JSUM_INIT;
+	uint32_t p = pos;
+	int valid = 1;
+	memset(t, 0, sizeof(struct jtxn));
+	t->seq = seq;
+
+	//Step 1: Descriptors, each followed by the blocks it lists
+	while (1) {
+		if (journal_read(p, desc, 1) < 0 || d->magic != JDESC_MAGIC || d->seq != seq
+				|| d->count > JDESC_MAX || t->count + d->count + 2 > j_len) {
+			valid = 0;
+			break;
+		}
+		sum = jsum(sum, desc);
+		t->blocks = realloc(t->blocks, (t->count + d->count) * sizeof(int));
+		t->data = realloc(t->data, (size_t) (t->count + d->count) * BLOCK_SIZE);
+		if (d->count > 0 && journal_read(p + 1, t->data + (size_t) t->count * BLOCK_SIZE, d->count) < 0) {
+			valid = 0;
+			break;
+		}
+		for (uint32_t i = 0; i < d->count; i++) {
+			t->blocks[t->count + i] = d->home[i];
+			sum = jsum(sum, t->data + (size_t) (t->count + i) * BLOCK_SIZE);
+		}
+		t->count += d->count;
+		p += 1 + d->count;
+		if (!d->more) {
+			break;
+		}
+	}
+
+	//Step 2: Revoke blocks, if the next block is not the commit already
+	while (valid) {
+		if (journal_read(p, desc, 1) < 0) {
+			valid = 0;
+		}
+		if (!valid || d->magic != JREVOKE_MAGIC) {
+			break;
+		}
+		if (d->seq != seq || d->count > JDESC_MAX || p - pos + 2 > j_len) {
+			valid = 0;
+			break;
+		}
+		sum = jsum(sum, desc);
+		t->revoke = realloc(t->revoke, (t->nrevoke + d->count) * sizeof(int));
+		for (uint32_t i = 0; i < d->count; i++) {
+			t->revoke[t->nrevoke + i] = d->home[i];
+		}
+		t->nrevoke += d->count;
+		p++;
+		if (!d->more) {
+			valid = journal_read(p, desc, 1) >= 0;
+			break;
+		}
+	}
+
+	//Step 3: It counts only if its commit block made it, intact
+	if (valid) {
+		struct jcommit *c = (struct jcommit *) desc;
+		valid = c->magic == JCOMMIT_MAGIC && c->seq == seq && c->count == (uint32_t) t->count
+			&& c->revoked == (uint32_t) t->nrevoke && c->checksum == sum;
+	}
+	free(desc);
+	if (!valid) {
+		free(t->blocks);
+		free(t->data);
+		free(t->revoke);
+		memset(t, 0, sizeof(struct jtxn));
+		return -1;
+	}
+	return (p + 1) % j_len;
+}
+
+/*
+ * Replay the committed transactions found in the log from its tail on and
+ * reset it to empty. Returns how many were replayed. The log is read twice:
+ * first to learn which blocks were revoked, then to put back the copies
+ * that were not revoked after they were logged.
+ */
+static int journal_replay() {
+	struct jtxn t;
+	struct jrevoked *revoked = NULL;
+	int nrevoked = 0, replayed = 0;
+	uint32_t pos = j_tail, seq = j_tail_seq;
+
+	//Step 1: Find the committed transactions and what they revoked
+	int64_t next;
+	while ((next = journal_read_txn(pos, seq, &t)) >= 0) {
+		jrevoked_add(&revoked, &nrevoked, t.revoke, t.nrevoke, seq);
+		free(t.blocks);
+		free(t.data);
+		free(t.revoke);
+		pos = next;
+		seq++;
+		replayed++;
+	}
+	nrevoked = jrevoked_sort(revoked, nrevoked);
+
+	//Step 2: Put their blocks back where they belong, oldest first
+	pos = j_tail;
+	for (int k = 0; k < replayed; k++) {
+		next = journal_read_txn(pos, j_tail_seq + k, &t);
+		int n = 0;
+		void **bufs = malloc(t.count * sizeof(void *));
+		for (int i = 0; i < t.count; i++) {
+			if (!jrevoked_has(revoked, nrevoked, t.blocks[i], t.seq)) {
+				t.blocks[n] = t.blocks[i];
+				bufs[n++] = t.data + (size_t) i * BLOCK_SIZE;
+			}
+		}
+		bio_writev(t.blocks, (const void *const *) bufs, n);
+		free(bufs);
+		free(t.blocks);
+		free(t.data);
+		free(t.revoke);
+		pos = next;
+	}
+	free(revoked);
+
+	if (replayed > 0) {
+		dev_barrier();
+	}
+	j_head = j_tail = pos;
+	j_seq = j_tail_seq = seq;
+	if (replayed > 0) {
+		journal_write_super();
+	}
+	return replayed;
+}
+
+//Lay out an empty journal of nblocks blocks starting at start_blk
+void journal_format(int start_blk, int nblocks) {
+	j_start = start_blk;
+	j_len = nblocks - 1;
+	j_head = j_tail = 0;
+	j_seq = j_tail_seq = 1;
+	journal_write_super();
+}
+
+/*
+ * Open the journal at start_blk, replaying what it holds, and start logging.
+ * prepare is called at every commit to push in-memory metadata into the
+ * block cache, and committed once the commit is on disk (ok) or has failed,
+ * before the next one begins. Returns the number of transactions replayed, or -1 if the
+ * journal is unusable. With the mmap backend blocks cannot be held back,
+ * so the journal is replayed but then left off.
+ */
+int journal_load(int start_blk, int nblocks, void (*prepare)(void), void (*committed)(int ok)) {
+	if (nblocks < 4) {
+		return -1;
+	}
+	j_start = start_blk;
+	j_len = nblocks - 1;
+
+	struct jsuper *js = malloc(BLOCK_SIZE);
+	int blk = start_blk;
+	void *buf = js;
+	if (bio_readv(&blk, &buf, 1) < 0) {
+		free(js);
+		return -1;
+	}
+	if (js->magic != JOURNAL_MAGIC || js->blocks != (uint32_t) nblocks || js->tail >= j_len) {
+		fprintf(stderr, "journal: no valid journal super block, starting an empty one\n");
+		journal_format(start_blk, nblocks);
+	}
+	else {
+		j_tail = js->tail;
+		j_tail_seq = js->tail_seq;
+	}
+	free(js);
+
+	int replayed = journal_replay();
+	if (bio_log_start(j_seq) < 0) {
+		return replayed;
+	}
+
+	//A transaction never outgrows a quarter of the cache or half the log
+	j_txn_max = BCACHE_NBUF / 4;
+	if (j_txn_max > (int) j_len / 2) {
+		j_txn_max = j_len / 2;
+	}
+	j_prepare = prepare;
+	j_committed = committed;
+	j_started = j_finished = 0;
+	j_error = 0;
+	j_active = 1;
+
+	j_kicked = 0;
+	j_thread_running = 1;
+	if (pthread_create(&j_thread, NULL, journal_worker, NULL) != 0) {
+		perror("journal thread failed, committing on demand only");
+		j_thread_running = 0;
+	}
+	return replayed;
+}
+
+//Commit and checkpoint everything and stop logging
+void journal_close() {
+	if (!j_active) {
+		return;
+	}
+	pthread_mutex_lock(&j_lock);
+	if (j_thread_running) {
+		j_thread_running = 0;
+		pthread_cond_signal(&j_kick);
+		pthread_mutex_unlock(&j_lock);
+		pthread_join(j_thread, NULL);
+		pthread_mutex_lock(&j_lock);
+	}
+	while (j_committing) {
+		pthread_cond_wait(&j_cond, &j_lock);
+	}
+	if (!j_error) {
+		journal_do_commit();
+	}
+	j_committing = 1;
+	pthread_mutex_unlock(&j_lock);
+
+	//What did commit goes home; after a failure the rest stays held and is
+	//never written back
+	journal_checkpoint(NULL);
+	if (!j_error) {
+		bio_log_stop();
+	}
+	else {
+		fprintf(stderr, "journal: dropping the metadata changed since the failed commit\n");
+	}
+
+	pthread_mutex_lock(&j_lock);
+	free(j_revoke);
+	j_revoke = NULL;
+	j_nrevoke = j_revoke_cap = 0;
+	j_committing = 0;
+	j_active = 0;
+	pthread_mutex_unlock(&j_lock);
+}
+
+int journal_active() {
+	return j_active;
+}
+
+//Begin a metadata operation. Calls nest; take it before any file system lock.
+//Returns 0, or -1 without beginning it once the journal has failed.
+int journal_start() {
+	if (!j_active) {
+		return 0;
+	}
+	if (j_depth > 0) {
+		j_depth++;
+		return 0;
+	}
+	pthread_mutex_lock(&j_lock);
+	//A transaction that has grown too big is committed before it grows more
+	if (bio_log_count() >= j_txn_max && !j_committing && !j_error) {
+		journal_do_commit();
+	}
+	while (j_barrier) {
+		pthread_cond_wait(&j_cond, &j_lock);
+	}
+	if (j_error) {
+		pthread_mutex_unlock(&j_lock);
+		return -1;
+	}
+	j_depth++;
+	j_handles++;
+	pthread_mutex_unlock(&j_lock);
+	return 0;
+}
+
+//End a metadata operation. Returns 0, or -1 if the journal has failed and
+//its changes will never be durable.
+int journal_stop() {
+	if (!j_active || --j_depth > 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&j_lock);
+	if (--j_handles == 0 && j_barrier) {
+		pthread_cond_broadcast(&j_cond);
+	}
+	int retstat = j_error ? -1 : 0;
+	pthread_mutex_unlock(&j_lock);
+	return retstat;
+}
+
+/*
+ * Get the operations finished so far committed. Without wait this only
+ * asks the commit thread to do it soon; with wait it returns once they
+ * are durable in the journal, together with all data written before.
+ * Returns 0 or -1.
+ */
+int journal_commit(int wait) {
+	if (!j_active) {
+		return 0;
+	}
+	pthread_mutex_lock(&j_lock);
+	if (!wait) {
+		j_kicked = 1;
+		pthread_cond_signal(&j_kick);
+		pthread_mutex_unlock(&j_lock);
+		return 0;
+	}
+
+	//A commit already past its barrier may have missed our operations
+	unsigned target = j_started + 1;
+	while ((int) (j_finished - target) < 0 && !j_error) {
+		if (!j_committing) {
+			journal_do_commit();
+		}
+		else {
+			pthread_cond_wait(&j_cond, &j_lock);
+		}
+	}
+	int retstat = j_error ? -1 : 0;
+	pthread_mutex_unlock(&j_lock);
+	if (dev_barrier() < 0) {
+		retstat = -1;
+	}
+	return retstat;
+}
+
+//Keep the logged copies of blk, just freed by the operation in progress,
+//from being checkpointed or replayed over whatever it holds next
+void journal_revoke(int blk) {
+	if (!j_active) {
+		return;
+	}
+	pthread_mutex_lock(&j_lock);
+	while (j_revoke_wait) {
+		pthread_cond_wait(&j_cond, &j_lock);
+	}
+	if (j_nrevoke == j_revoke_cap) {
+		j_revoke_cap = j_revoke_cap > 0 ? 2 * j_revoke_cap : 64;
+		j_revoke = realloc(j_revoke, j_revoke_cap * sizeof(int));
+	}
+	j_revoke[j_nrevoke++] = blk;
+	pthread_mutex_unlock(&j_lock);
+}
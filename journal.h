@@ -0,0 +1,75 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	journal.h
+ *
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+#include "block.h"
+
+//How long a transaction stays open before the commit thread writes it, in ms
+#ifndef JOURNAL_COMMIT_MS
+#define JOURNAL_COMMIT_MS 1000
+#endif
+
+#define JOURNAL_MAGIC	0x4A524E4C		/* journal super block */
+#define JDESC_MAGIC		0x4A445343		/* descriptor block */
+#define JCOMMIT_MAGIC	0x4A434D54		/* commit block */
+#define JREVOKE_MAGIC	0x4A52564B		/* revoke block */
+
+/*
+ * On-disk journal
+ *
+ * The first block of the journal area is its super block; the rest is a
+ * circular log. A transaction is logged as one or more descriptor blocks,
+ * each followed by copies of the blocks it lists, then any revoke blocks,
+ * and closed by a commit block carrying a checksum of everything before
+ * it. Sequence numbers of consecutive transactions are consecutive, so
+ * replay stops at the first record that is stale, torn or missing.
+ *
+ * A revoke block has the layout of a descriptor but no copies follow it:
+ * it lists blocks the transaction freed. Copies of those logged by it or
+ * by an earlier transaction are neither checkpointed nor replayed, so a
+ * freed metadata block that now holds file data, which is not logged, is
+ * not overwritten with what it held before.
+ */
+struct jsuper {
+	uint32_t	magic;
+	uint32_t	blocks;				/* size of the journal area, super block included */
+	uint32_t	tail;				/* log position of the oldest live transaction */
+	uint32_t	tail_seq;			/* its sequence number */
+};
+
+struct jdesc {
+	uint32_t	magic;
+	uint32_t	seq;				/* transaction this descriptor belongs to */
+	uint32_t	count;				/* blocks listed, and following it in the log */
+	uint32_t	more;				/* another descriptor follows before the commit */
+	uint32_t	home[];				/* where each logged block belongs */
+};
+
+#define JDESC_MAX ((BLOCK_SIZE - sizeof(struct jdesc)) / sizeof(uint32_t))
+
+struct jcommit {
+	uint32_t	magic;
+	uint32_t	seq;
+	uint32_t	count;				/* blocks logged by the whole transaction */
+	uint32_t	revoked;			/* blocks it revoked */
+	uint64_t	checksum;			/* over everything logged before it */
+};
+
+void journal_format(int start_blk, int nblocks);
+int journal_load(int start_blk, int nblocks, void (*prepare)(void), void (*committed)(int ok));
+void journal_close();
+int journal_active();
+int journal_start();
+int journal_stop();
+int journal_commit(int wait);
+void journal_revoke(int blk);
+
+#endif
@@ -0,0 +1,79 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	mkfs.c
+ *
+ *	mkfs.rufs [-b block_size] [-s disk_size] [-N inodes] [-J journal_blocks]
+ *		[-g group_blocks] [-I inode_size] diskfile
+ *
+ *	Sizes take a K, M or G suffix. The inode table grows as files are
+ *	made, so -N only caps the number of inodes, one per block by default.
+ *	Without -J the journal gets JOURNAL_BLOCKS blocks or an eighth of the
+ *	disk, whichever is smaller. Without -g the disk is
+ *	cut into about 16 allocation groups of up to one bitmap block each.
+ *	Inodes take INODE_SIZE_DEFAULT bytes unless -I asks for 128, which
+ *	packs twice as many per block but keeps less data inline.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+//Parse a size with an optional K, M or G suffix, -1 if it is not one
+static long long parse_size(const char *arg) {
+	char *end;
+	long long n = strtoll(arg, &end, 0);
+	switch(*end){
+		case 'G': case 'g': n *= 1024;	/* fall through */
+		case 'M': case 'm': n *= 1024;	/* fall through */
+		case 'K': case 'k': n *= 1024; end++; break;
+		default: break;
+	}
+	return *end == '\0' && n > 0 ? n : -1;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-b block_size] [-s disk_size] [-N inodes] [-J journal_blocks] [-g group_blocks] [-I inode_size] diskfile\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+	struct rufs_geometry geo = { DISK_SIZE, BLOCK_SIZE_MIN, 0, 0, 0, 0 };
+	long long n;
+	int opt;
+
+	while((opt = getopt(argc, argv, "b:s:N:J:g:I:")) != -1){
+		n = optarg != NULL ? parse_size(optarg) : -1;
+		switch(opt){
+			case 'b': geo.block_size = n; break;
+			case 's': geo.disk_size = n; break;
+			case 'N': geo.max_inum = n; break;
+			case 'J': geo.j_blocks = n; break;
+			case 'g': geo.group_blocks = n; break;
+			case 'I': geo.inode_size = n; break;
+			default: usage(argv[0]);
+		}
+		if(n < 0 || (opt != 's' && n > INT32_MAX)){
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1){
+		usage(argv[0]);
+	}
+
+	if(geo.j_blocks == 0){
+		n = geo.disk_size / geo.block_size / 8;
+		geo.j_blocks = n < JOURNAL_BLOCKS ? n : JOURNAL_BLOCKS;
+	}
+
+	if(rufs_format(argv[optind], &geo) < 0){
+		return EXIT_FAILURE;
+	}
+	printf("%s: %lld blocks of %d bytes, up to %u inodes, %u block journal\n", argv[optind],
+		(long long) (geo.disk_size / geo.block_size), geo.block_size, geo.max_inum, geo.j_blocks);
+	return EXIT_SUCCESS;
+}
@@ -8,18 +8,22 @@
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "block.h"
+#include "journal.h"
 #include "rufs.h"
 
 char diskfile_path[PATH_MAX];
@@ -28,23 +32,433 @@ char diskfile_path[PATH_MAX];
 struct superblock *superblock;
 bitmap_t i_bmap;	//i node bitmap
 bitmap_t d_bmap;	//data bitmap
-int num_dir = BLOCK_SIZE / sizeof(struct dirent);
-/* 
- * Get available inode number from bitmap
+
+// The in-memory bitmaps are the source of truth; they are written back lazily,
+// one block at a time, with a dirty flag per bitmap block.
+char *i_bmap_dirty = NULL;
+char *d_bmap_dirty = NULL;
+int i_bmap_blocks = 0;	//blocks taken by each bitmap on disk
+int d_bmap_blocks = 0;
+
+/*
+ * Free-extent index
+ *
+ * Every allocation group keeps a segment tree over the 64-bit words of its
+ * slice of d_bmap. A node holds the free run at the start of its span, the
+ * one at its end and the longest one inside, so finding n contiguous free
+ * blocks at or after h is one walk down the tree rather than a bitmap scan.
+ * The bitmap stays the source of truth: the tree is built from it at mount
+ * and a word's leaf is refreshed whenever its group changes bits in it.
  */
-int get_avail_ino() {
+struct fx_node {
+	int pre;			//free blocks at the start of the span
+	int suf;			//free blocks at the end of the span
+	int best;			//longest free run in the span
+};
 
-	// Step 1: Read inode bitmap from disk
-	bio_read(superblock->i_bitmap_blk, i_bmap);
-	// Step 2: Traverse inode bitmap to find an available slot
-	int block = 0;
-	while(block < MAX_INUM && get_bitmap(i_bmap, block) != 0){
-		block++;
+struct fx_tree {
+	uint64_t *words;	//the group's bitmap slice
+	int nbits;			//blocks in the group
+	int leaves;			//a power of two, at least one per word
+	struct fx_node *nodes;	//nodes[1] is the root, leaf w is nodes[leaves + w]
+};
+
+//Word w of the bitmap, with the bits past the end of the group in use
+static inline uint64_t fx_word(struct fx_tree *t, int w) {
+	if(w * 64 >= t->nbits){
+		return ~0ULL;
+	}
+	if(t->nbits - w * 64 < 64){
+		return t->words[w] | ~0ULL << (t->nbits - w * 64);
+	}
+	return t->words[w];
+}
+
+static void fx_leaf(struct fx_tree *t, int w) {
+	struct fx_node *x = &t->nodes[t->leaves + w];
+	uint64_t used = fx_word(t, w);
+	if(used == 0){
+		x->pre = x->suf = x->best = 64;
+		return;
+	}
+	x->pre = __builtin_ctzll(used);
+	x->suf = __builtin_clzll(used);
+	// Each round shortens every free run by one
+	uint64_t avail = ~used;
+	for(x->best = 0; avail != 0; x->best++){
+		avail &= avail >> 1;
+	}
+}
+
+//Recompute node i from its children, each spanning len blocks
+static void fx_pull(struct fx_tree *t, int i, int len) {
+	struct fx_node *l = &t->nodes[2 * i], *r = &t->nodes[2 * i + 1], *x = &t->nodes[i];
+	x->pre = l->pre == len ? len + r->pre : l->pre;
+	x->suf = r->suf == len ? len + l->suf : r->suf;
+	x->best = l->best > r->best ? l->best : r->best;
+	if(l->suf + r->pre > x->best){
+		x->best = l->suf + r->pre;
+	}
+}
+
+//Refresh the index after bitmap words w0 to w1 changed
+static void fx_update(struct fx_tree *t, int w0, int w1) {
+	for(int w = w0; w <= w1; w++){
+		fx_leaf(t, w);
+	}
+	int len = 64;
+	for(int lo = (t->leaves + w0) / 2, hi = (t->leaves + w1) / 2; lo >= 1; lo /= 2, hi /= 2, len *= 2){
+		for(int i = lo; i <= hi; i++){
+			fx_pull(t, i, len);
+		}
+	}
+}
+
+static void fx_build(struct fx_tree *t, uint64_t *words, int nbits) {
+	t->words = words;
+	t->nbits = nbits;
+	for(t->leaves = 1; t->leaves * 64 < nbits; t->leaves *= 2);
+	t->nodes = malloc(2 * t->leaves * sizeof(struct fx_node));
+	fx_update(t, 0, t->leaves - 1);
+}
+
+/*
+ * First run of n free blocks starting at or after h within the span of
+ * node i, [lo, lo + len), given that *run free blocks end right at lo.
+ * Returns its start, or -1 with *run set to the free blocks ending at
+ * lo + len. Only nodes straddling h or holding such a run are entered.
+ */
+static int fx_find(struct fx_tree *t, int i, int lo, int len, int h, int n, int *run) {
+	struct fx_node *x = &t->nodes[i];
+	if(lo + len <= h){
+		*run = 0;
+		return -1;
+	}
+	if(lo >= h){
+		if(*run + x->pre >= n){
+			return lo - *run;
+		}
+		if(x->best < n){
+			*run = x->pre == len ? *run + len : x->suf;
+			return -1;
+		}
+	}
+	if(len == 64){
+		uint64_t used = fx_word(t, i - t->leaves);
+		for(int b = lo < h ? h - lo : 0; b < 64; b++){
+			if(used >> b & 1){
+				*run = 0;
+			}
+			else if(++*run >= n){
+				return lo + b - n + 1;
+			}
+		}
+		return -1;
+	}
+	int bit = fx_find(t, 2 * i, lo, len / 2, h, n, run);
+	return bit >= 0 ? bit : fx_find(t, 2 * i + 1, lo + len / 2, len / 2, h, n, run);
+}
+
+//First run of n free blocks at or after h, wrapping around, or -1
+static int fx_first(struct fx_tree *t, int h, int n) {
+	int run = 0;
+	int bit = fx_find(t, 1, 0, t->leaves * 64, h, n, &run);
+	if(bit < 0 && h > 0){
+		run = 0;
+		bit = fx_find(t, 1, 0, t->leaves * 64, 0, n, &run);
+	}
+	return bit;
+}
+
+//Longest free run in the tree
+static inline int fx_longest(struct fx_tree *t) {
+	return t->nodes[1].best;
+}
+
+/*
+ * Allocation groups
+ *
+ * The disk is split into groups of superblock->group_blocks blocks and
+ * superblock->group_inodes inodes. Each group owns its slice of both
+ * bitmaps, guarded by its own lock together with its free counts and
+ * search hints, so threads allocating in different groups do not contend.
+ * New files go in their parent's group, directories are spread over the
+ * groups with room to spare, and a file's data starts out in its inode's
+ * group.
+ *
+ * alloc_lock only guards the disk-wide counters below. An allocation takes
+ * its share of them before searching, so some group is sure to have it.
+ * Group locks come before alloc_lock, and are taken in increasing order.
+ */
+struct alloc_group {
+	pthread_mutex_t lock;
+	int i_free;			//free inodes in the group
+	int d_free;			//free blocks in the group
+	int i_unmapped;		//inodes in table chunks not allocated yet, see inode_grow()
+	int i_cursor;		//next-free search hints, relative to the group start
+	int d_cursor;
+	struct fx_tree fx;	//free-extent index of the group's blocks
+};
+
+struct alloc_group *groups = NULL;
+int ngroups = 0;
+
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;	//serializes inode table growth, taken before group locks
+int i_free = 0;		//free inodes not yet taken by an allocation
+int d_free = 0;		//free data blocks not yet taken by an allocation
+int d_reserved = 0;	//free data blocks promised to delayed allocations
+
+/*
+ * Find, claim and return the first clear bit at or after *cursor (wrapping
+ * around), scanning 64 bits at a time. Returns -1 if every bit is set.
+ * The bitmap layout (bit i in byte i/8) makes word w hold bits w*64..w*64+63
+ * on a little-endian host.
+ */
+static int bitmap_alloc(bitmap_t b, int nbits, int *cursor) {
+	uint64_t *words = (uint64_t *) b;
+	int nwords = (nbits + 63) / 64;
+	int start = *cursor < nbits ? *cursor : 0;
+
+	// The starting word is visited twice: first from the cursor on, and
+	// again in full after wrapping around
+	for(int n = 0; n <= nwords; n++){
+		int w = (start / 64 + n) % nwords;
+		uint64_t avail = ~words[w];
+		if(n == 0){
+			avail &= ~0ULL << (start & 63);
+		}
+		if(w == nwords - 1 && (nbits & 63) != 0){
+			avail &= (1ULL << (nbits & 63)) - 1;
+		}
+		if(avail == 0){
+			continue;
+		}
+		int bit = w * 64 + __builtin_ctzll(avail);
+		set_bitmap(b, bit);
+		*cursor = bit + 1 < nbits ? bit + 1 : 0;
+		return bit;
+	}
+	return -1;
+}
+
+//Flag the bitmap blocks holding bits [bit, bit + count) for bitmap_sync()
+static void bitmap_touch(char *dirty, int bit, int count) {
+	for(int k = bit / (8 * BLOCK_SIZE); k <= (bit + count - 1) / (8 * BLOCK_SIZE); k++){
+		dirty[k] = 1;
+	}
+}
+
+//Count the clear bits in the first nbits of a bitmap
+static int bitmap_count_free(bitmap_t b, int nbits) {
+	uint64_t *words = (uint64_t *) b;
+	int used = 0;
+	for(int w = 0; w < nbits / 64; w++){
+		used += __builtin_popcountll(words[w]);
+	}
+	for(int i = nbits & ~63; i < nbits; i++){
+		used += get_bitmap(b, i);
+	}
+	return nbits - used;
+}
+
+//Read a bitmap of nbits bits starting at block start_blk into memory
+static bitmap_t bitmap_read(int start_blk, int nbits) {
+	int nblocks = BITMAP_BLOCKS(nbits);
+	bitmap_t b = malloc((size_t) nblocks * BLOCK_SIZE);
+	int *blocks = malloc(nblocks * sizeof(int));
+	void **bufs = malloc(nblocks * sizeof(void *));
+	for(int k = 0; k < nblocks; k++){
+		blocks[k] = start_blk + k;
+		bufs[k] = b + (size_t) k * BLOCK_SIZE;
+	}
+	bio_readv(blocks, bufs, nblocks);
+	free(bufs);
+	free(blocks);
+	return b;
+}
+
+static inline int group_of_blk(int blk) {
+	return blk / superblock->group_blocks;
+}
+
+static inline int group_of_ino(int ino) {
+	return ino / superblock->group_inodes;
+}
+
+//Blocks and inodes in group g, the last group may be short
+static inline int group_nblocks(int g) {
+	int left = (int) superblock->max_dnum - g * (int) superblock->group_blocks;
+	return left < (int) superblock->group_blocks ? left : (int) superblock->group_blocks;
+}
+
+static inline int group_ninodes(int g) {
+	int left = (int) superblock->max_inum - g * (int) superblock->group_inodes;
+	return left < 0 ? 0 : left < (int) superblock->group_inodes ? left : (int) superblock->group_inodes;
+}
+
+/*
+ * Where the data of inode ino starts out: the first block of its group
+ */
+int inode_goal(uint32_t ino) {
+	int g = group_of_ino(ino);
+	return g < ngroups ? g * superblock->group_blocks : 0;
+}
+
+/*
+ * Set up the groups and the free counts from the bitmaps just read
+ */
+static void groups_init() {
+	ngroups = (superblock->max_dnum + superblock->group_blocks - 1) / superblock->group_blocks;
+	groups = calloc(ngroups, sizeof(struct alloc_group));
+	i_free = d_free = 0;
+	for(int g = 0; g < ngroups; g++){
+		pthread_mutex_init(&groups[g].lock, NULL);
+		groups[g].i_free = bitmap_count_free(i_bmap + g * superblock->group_inodes / 8, group_ninodes(g));
+		for(int c = 0; c < group_ninodes(g) / (int) superblock->i_chunk_inodes; c++){
+			if(superblock->i_chunk_blk[g * superblock->group_inodes / superblock->i_chunk_inodes + c] == 0){
+				groups[g].i_unmapped += superblock->i_chunk_inodes;
+			}
+		}
+		groups[g].d_free = bitmap_count_free(d_bmap + g * superblock->group_blocks / 8, group_nblocks(g));
+		fx_build(&groups[g].fx, (uint64_t *) (d_bmap + g * superblock->group_blocks / 8), group_nblocks(g));
+		i_free += groups[g].i_free;
+		d_free += groups[g].d_free;
+	}
+}
+
+static void groups_destroy() {
+	for(int g = 0; g < ngroups; g++){
+		pthread_mutex_destroy(&groups[g].lock);
+		free(groups[g].fx.nodes);
+	}
+	free(groups);
+	groups = NULL;
+	ngroups = 0;
+}
+
+//Claim a free inode in group g, -1 if it has none
+static int group_alloc_ino(int g) {
+	struct alloc_group *grp = &groups[g];
+	int ino = -1;
+	pthread_mutex_lock(&grp->lock);
+	if(grp->i_free > 0){
+		int base = g * superblock->group_inodes;
+		int bit = bitmap_alloc(i_bmap + base / 8, group_ninodes(g), &grp->i_cursor);
+		if(bit >= 0){
+			ino = base + bit;
+			grp->i_free--;
+			bitmap_touch(i_bmap_dirty, ino, 1);
+		}
+	}
+	pthread_mutex_unlock(&grp->lock);
+	return ino;
+}
+
+/*
+ * Group for a new directory: of the groups after the parent's with at
+ * least the average number of inodes to spare, counting table chunks yet
+ * to be added, the one with the most free blocks, so that directories
+ * spread out and their files have room nearby. The counts are only read
+ * as a hint.
+ */
+static int group_spare_inodes(int g) {
+	return __atomic_load_n(&groups[g].i_free, __ATOMIC_RELAXED) + __atomic_load_n(&groups[g].i_unmapped, __ATOMIC_RELAXED);
+}
+
+static int find_group_dir(int parent_g) {
+	long total = 0;
+	for(int g = 0; g < ngroups; g++){
+		total += group_spare_inodes(g);
+	}
+	int avg = total / ngroups;
+	int best = parent_g, best_free = -1;
+	for(int n = 1; n <= ngroups; n++){
+		int g = (parent_g + n) % ngroups;
+		int gi = group_spare_inodes(g);
+		int gd = __atomic_load_n(&groups[g].d_free, __ATOMIC_RELAXED);
+		if(gi > 0 && gi >= avg && gd > best_free){
+			best = g;
+			best_free = gd;
+		}
+	}
+	return best;
+}
+
+//Mark blocks [bit, bit + len) of group g in use, with its lock held
+static void group_claim(struct alloc_group *grp, int g, int bit, int len) {
+	int base = g * superblock->group_blocks;
+	for(int i = 0; i < len; i++){
+		set_bitmap(d_bmap, base + bit + i);
+	}
+	fx_update(&grp->fx, bit / 64, (bit + len - 1) / 64);
+	grp->d_free -= len;
+	grp->d_cursor = bit + len < grp->fx.nbits ? bit + len : 0;
+	bitmap_touch(d_bmap_dirty, base + bit, len);
+}
+
+/*
+ * Claim the first free block of group g at or after goal, or from the
+ * group's own hint if goal is outside it. Returns -1 if the group is full.
+ */
+static int group_alloc_blk(int g, int goal) {
+	struct alloc_group *grp = &groups[g];
+	int blk = -1;
+	pthread_mutex_lock(&grp->lock);
+	if(grp->d_free > 0){
+		int base = g * superblock->group_blocks;
+		int from = goal >= base && goal < base + grp->fx.nbits ? goal - base : grp->d_cursor;
+		int bit = fx_first(&grp->fx, from, 1);
+		if(bit >= 0){
+			group_claim(grp, g, bit, 1);
+			blk = base + bit;
+		}
+	}
+	pthread_mutex_unlock(&grp->lock);
+	return blk;
+}
+
+/*
+ * Group to start looking for blocks near goal in. Without a goal,
+ * allocations take turns over the groups instead of all contending for
+ * group 0's lock.
+ */
+static int goal_group(int goal) {
+	static unsigned rotor = 0;
+	if(goal >= 0 && goal < (int) superblock->max_dnum){
+		return group_of_blk(goal);
+	}
+	return __atomic_fetch_add(&rotor, 1, __ATOMIC_RELAXED) % ngroups;
+}
+
+/*
+ * Get the first available data block at or after goal, in goal's group or
+ * failing that the groups after it, so that consecutive blocks of a file
+ * can land next to each other on disk. A negative goal starts in the next
+ * group in turn, continuing from where its last allocation left off.
+ */
+int get_avail_blkno_near(int goal) {
+
+	// Step 1: Take one from the free count, so some group is sure to have it.
+	// Blocks reserved for delayed allocations are not up for grabs
+	pthread_mutex_lock(&alloc_lock);
+	if(d_free - d_reserved <= 0){
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	d_free--;
+	pthread_mutex_unlock(&alloc_lock);
+
+	// Step 2: Traverse the group block bitmaps a word at a time to find an
+	// available slot, marking its bitmap block dirty for the next flush
+	int start = goal_group(goal);
+	if(goal >= (int) superblock->max_dnum){
+		goal = -1;
+	}
+	int block = -1;
+	for(int n = 0; block < 0; n++){
+		block = group_alloc_blk((start + n) % ngroups, goal);
 	}
-	
-	// Step 3: Update inode bitmap and write to disk 
-	set_bitmap(i_bmap, block);
-	bio_write(superblock->i_bitmap_blk, i_bmap);
 	return block;
 }
 
@@ -52,424 +466,3471 @@ int get_avail_ino() {
  * Get available data block number from bitmap
  */
 int get_avail_blkno() {
+	return get_avail_blkno_near(-1);
+}
+
+/*
+ * Set count free data blocks aside for data whose allocation is delayed, so
+ * that placing it later cannot run out of space. Returns 0, or -1 if fewer
+ * than count unreserved blocks are left.
+ */
+int reserve_blkno(int count) {
+	int ret = -1;
+	pthread_mutex_lock(&alloc_lock);
+	if(d_free - d_reserved >= count){
+		d_reserved += count;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return ret;
+}
+
+void unreserve_blkno(int count) {
+	pthread_mutex_lock(&alloc_lock);
+	d_reserved -= count;
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * Claim the first run of want free blocks in group g from goal, or from
+ * the group's hint if goal is outside it, wrapping around. Without one,
+ * the group's longest run is claimed if any will do. Returns the first
+ * block and sets *got to the run length, or -1 with *got set to the
+ * group's longest run.
+ */
+static int group_alloc_run(int g, int goal, int want, int any, int *got) {
+	struct alloc_group *grp = &groups[g];
+	int blk = -1;
+	pthread_mutex_lock(&grp->lock);
+	int len = fx_longest(&grp->fx) < want ? fx_longest(&grp->fx) : want;
+	*got = len;
+	if(len > 0 && (len == want || any)){
+		int base = g * superblock->group_blocks;
+		int from = goal >= base && goal < base + grp->fx.nbits ? goal - base : grp->d_cursor;
+		int bit = fx_first(&grp->fx, from, len);
+		group_claim(grp, g, bit, len);
+		blk = base + bit;
+	}
+	pthread_mutex_unlock(&grp->lock);
+	return blk;
+}
+
+/*
+ * Claim up to want contiguous data blocks near goal out of an earlier
+ * reserve_blkno(): the first long enough run from goal's group on, or else
+ * the longest one seen. Returns the first block and sets *got to how many
+ * were claimed.
+ */
+int get_reserved_blkno_run(int goal, int want, int *got) {
+	int start = goal_group(goal);
+	if(goal >= (int) superblock->max_dnum){
+		goal = -1;
+	}
+	int best = start, best_len = 0;
+	int block = -1;
+
+	// Step 1: First group with a long enough run
+	for(int n = 0; n < ngroups && block < 0; n++){
+		int g = (start + n) % ngroups;
+		block = group_alloc_run(g, goal, want, 0, got);
+		if(block < 0 && *got > best_len){
+			best = g;
+			best_len = *got;
+		}
+	}
 
-	// Step 1: Read data block bitmap from disk
-	bio_read(superblock->d_bitmap_blk, d_bmap);
-	// Step 2: Traverse data block bitmap to find an available slot
-	int block = 0;
-	while(block < MAX_DNUM && get_bitmap(d_bmap, block) != 0){
-		block++;
+	// Step 2: Settle for the longest run, or whatever a group has left once
+	// other allocations have been at it. The blocks were reserved, so some
+	// group has one
+	for(int n = 0; block < 0; n++){
+		block = group_alloc_run((best + n) % ngroups, goal, want, 1, got);
 	}
 
-	// Step 3: Update data block bitmap and write to disk 
-	set_bitmap(d_bmap, block);
-	bio_write(superblock->d_bitmap_blk, d_bmap);
+	pthread_mutex_lock(&alloc_lock);
+	d_free -= *got;
+	d_reserved -= *got;
+	pthread_mutex_unlock(&alloc_lock);
 	return block;
 }
 
-/* 
- * inode operations
+/*
+ * Claim up to want contiguous data blocks near goal without an earlier
+ * reservation. Returns the first block and sets *got to how many were
+ * claimed, or -1 if no unreserved block is free.
+ */
+int get_avail_blkno_run(int goal, int want, int *got) {
+
+	// Step 1: Reserve as many as are free, up to want
+	pthread_mutex_lock(&alloc_lock);
+	if(want > d_free - d_reserved){
+		want = d_free - d_reserved;
+	}
+	if(want <= 0){
+		pthread_mutex_unlock(&alloc_lock);
+		return -1;
+	}
+	d_reserved += want;
+	pthread_mutex_unlock(&alloc_lock);
+
+	// Step 2: Place them like delayed blocks and give back what did not fit
+	// in one run
+	int block = get_reserved_blkno_run(goal, want, got);
+	if(*got < want){
+		unreserve_blkno(want - *got);
+	}
+	return block;
+}
+
+/*
+ * Lists of physical block runs, gathered so that they can be freed or
+ * discarded in block order, touching runs merged
+ */
+struct block_run {
+	uint32_t pblk;
+	uint32_t len;
+};
+
+struct block_runs {
+	struct block_run *runs;
+	int count, cap;
+};
+
+static void block_runs_add(struct block_runs *r, uint32_t pblk, uint32_t len) {
+	if(r->count == r->cap){
+		r->cap = r->cap > 0 ? 2 * r->cap : 16;
+		r->runs = realloc(r->runs, r->cap * sizeof(struct block_run));
+	}
+	r->runs[r->count].pblk = pblk;
+	r->runs[r->count++].len = len;
+}
+
+static int cmp_block_run(const void *a, const void *b) {
+	const struct block_run *x = a, *y = b;
+	return x->pblk < y->pblk ? -1 : x->pblk > y->pblk;
+}
+
+//Sort the runs and merge the ones that touch or overlap
+static void block_runs_merge(struct block_runs *r) {
+	qsort(r->runs, r->count, sizeof(struct block_run), cmp_block_run);
+	int n = 0;
+	for(int i = 0; i < r->count; i++){
+		struct block_run *last = n > 0 ? &r->runs[n - 1] : NULL;
+		if(last != NULL && r->runs[i].pblk <= last->pblk + last->len){
+			uint32_t end = r->runs[i].pblk + r->runs[i].len;
+			if(end > last->pblk + last->len){
+				last->len = end - last->pblk;
+			}
+		}
+		else {
+			r->runs[n++] = r->runs[i];
+		}
+	}
+	r->count = n;
+}
+
+static void block_runs_clear(struct block_runs *r) {
+	free(r->runs);
+	r->runs = NULL;
+	r->count = r->cap = 0;
+}
+
+/*
+ * discard
+ *
+ * Freed blocks are punched out of the disk file (bio_discard()), so the
+ * image stays sparse and host-side copies skip dead data. A block may only
+ * go once the transaction that freed it has committed, or a crash could
+ * bring back a file whose blocks read as zeros. Runs freed while a
+ * transaction is open are set aside when it is closed (discard_close(),
+ * from journal_prepare()) and punched in one batch once its commit is on
+ * disk (discard_done()), before the next commit can begin. The bitmap is
+ * checked again under the group lock, so blocks allocated again in the
+ * meantime are left alone. Without a journal the runs go right after the
+ * bitmaps are written back.
+ *
+ * The same rule holds for allocating them again: data written in place
+ * into a block the journal still has mapped would be found by a replay.
+ * With a journal, freed runs stay allocated on free_freed; the transaction
+ * being committed takes them along with its discards and they are only
+ * returned to the bitmaps once its commit is on disk, then punched at
+ * once. bitmap_sync() writes them free into the bitmap blocks of the
+ * transaction that freed them all the same, so its commit frees them on
+ * disk.
+ *
+ * discard_lock guards the four lists and is never held with another lock.
+ */
+int discard_enabled = 1;		//punch freed blocks, turned off with --nodiscard
+int discard_at_mount = 0;		//punch every free block at mount, asked for with --trim
+pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+struct block_runs discard_freed;	//freed in the running transaction
+struct block_runs discard_ready;	//freed in the transaction being committed
+struct block_runs free_freed;		//freed in the running transaction, still allocated
+struct block_runs free_ready;		//freed in the transaction being committed, still allocated
+
+/*
+ * Return the len data blocks from blkno on to the bitmap in one pass per
+ * group, clearing whole 64-bit words where the run covers them. Blocks
+ * that are already free are left alone.
+ */
+static void release_blkno_run(int blkno, int len) {
+	uint64_t *words = (uint64_t *) d_bmap;
+	while(len > 0){
+		int g = group_of_blk(blkno);
+		struct alloc_group *grp = &groups[g];
+		int bit = blkno - g * superblock->group_blocks;
+		int n = grp->fx.nbits - bit < len ? grp->fx.nbits - bit : len;
+		int freed = 0;
+
+		pthread_mutex_lock(&grp->lock);
+		for(int b = blkno; b < blkno + n; ){
+			if((b & 63) == 0 && blkno + n - b >= 64){
+				freed += __builtin_popcountll(words[b / 64]);
+				words[b / 64] = 0;
+				b += 64;
+			}
+			else {
+				if(get_bitmap(d_bmap, b)){
+					unset_bitmap(d_bmap, b);
+					freed++;
+				}
+				b++;
+			}
+		}
+		fx_update(&grp->fx, bit / 64, (bit + n - 1) / 64);
+		grp->d_free += freed;
+		bitmap_touch(d_bmap_dirty, blkno, n);
+		pthread_mutex_unlock(&grp->lock);
+
+		if(freed > 0){
+			pthread_mutex_lock(&alloc_lock);
+			d_free += freed;
+			pthread_mutex_unlock(&alloc_lock);
+		}
+		blkno += n;
+		len -= n;
+	}
+}
+
+/*
+ * Free len data blocks from blkno on. With a journal they are set aside
+ * until the transaction in progress has committed, see above.
+ */
+void free_blkno_run(int blkno, int len) {
+	if(len <= 0){
+		return;
+	}
+	if(journal_active()){
+		pthread_mutex_lock(&discard_lock);
+		block_runs_add(&free_freed, blkno, len);
+		pthread_mutex_unlock(&discard_lock);
+		return;
+	}
+	if(discard_enabled){
+		pthread_mutex_lock(&discard_lock);
+		block_runs_add(&discard_freed, blkno, len);
+		pthread_mutex_unlock(&discard_lock);
+	}
+	release_blkno_run(blkno, len);
+}
+
+/*
+ * Return a data block obtained from get_avail_blkno() to the bitmap
+ */
+void free_blkno(int blkno) {
+	free_blkno_run(blkno, 1);
+}
+
+/*
+ * Give back len blocks from blkno on, claimed out of a reservation that is
+ * still needed, so that they are free and reserved again. The reservation
+ * goes back first, so no one else can take them in between. Nothing has
+ * mapped them yet, so they need not wait for a commit.
+ */
+void unclaim_blkno_run(int blkno, int len) {
+	pthread_mutex_lock(&alloc_lock);
+	d_reserved += len;
+	pthread_mutex_unlock(&alloc_lock);
+	release_blkno_run(blkno, len);
+}
+
+//Free every run of the list and empty it
+static void block_runs_free(struct block_runs *r) {
+	block_runs_merge(r);
+	for(int i = 0; i < r->count; i++){
+		free_blkno_run(r->runs[i].pblk, r->runs[i].len);
+	}
+	block_runs_clear(r);
+}
+
+/*
+ * Punch the free blocks among the len from blkno on out of the disk file,
+ * one group at a time with its lock held so that none of them is claimed
+ * meanwhile
+ */
+static void discard_range(int blkno, int len) {
+	uint64_t *words = (uint64_t *) d_bmap;
+	while(len > 0){
+		int g = group_of_blk(blkno);
+		int n = g * superblock->group_blocks + group_nblocks(g) - blkno;
+		if(n > len){
+			n = len;
+		}
+
+		pthread_mutex_lock(&groups[g].lock);
+		for(int b = blkno; b < blkno + n; ){
+			if((b & 63) == 0 && words[b / 64] == ~0ULL){
+				b += 64;
+				continue;
+			}
+			if(get_bitmap(d_bmap, b)){
+				b++;
+				continue;
+			}
+			int start = b;
+			while(b < blkno + n && !get_bitmap(d_bmap, b)){
+				b++;
+			}
+			bio_discard(start, b - start);
+		}
+		pthread_mutex_unlock(&groups[g].lock);
+
+		blkno += n;
+		len -= n;
+	}
+}
+
+/*
+ * The transaction being committed takes the runs freed so far. Called with
+ * no operation in flight
+ */
+static void discard_close() {
+	pthread_mutex_lock(&discard_lock);
+	for(int i = 0; i < discard_freed.count; i++){
+		block_runs_add(&discard_ready, discard_freed.runs[i].pblk, discard_freed.runs[i].len);
+	}
+	discard_freed.count = 0;
+	for(int i = 0; i < free_freed.count; i++){
+		block_runs_add(&free_ready, free_freed.runs[i].pblk, free_freed.runs[i].len);
+	}
+	free_freed.count = 0;
+	pthread_mutex_unlock(&discard_lock);
+}
+
+/*
+ * The transaction set aside by discard_close() has committed, or failed to
+ * if ok is 0, in which case its runs are not punched and the ones it freed
+ * stay allocated
+ */
+static void discard_done(int ok) {
+	pthread_mutex_lock(&discard_lock);
+	struct block_runs ready = discard_ready;
+	struct block_runs freed = free_ready;
+	discard_ready.runs = free_ready.runs = NULL;
+	discard_ready.count = discard_ready.cap = 0;
+	free_ready.count = free_ready.cap = 0;
+	pthread_mutex_unlock(&discard_lock);
+
+	if(ok){
+		block_runs_merge(&freed);
+		for(int i = 0; i < freed.count; i++){
+			release_blkno_run(freed.runs[i].pblk, freed.runs[i].len);
+			if(discard_enabled){
+				block_runs_add(&ready, freed.runs[i].pblk, freed.runs[i].len);
+			}
+		}
+		block_runs_merge(&ready);
+		for(int i = 0; i < ready.count; i++){
+			discard_range(ready.runs[i].pblk, ready.runs[i].len);
+		}
+	}
+	block_runs_clear(&freed);
+	block_runs_clear(&ready);
+}
+
+/*
+ * Write the dirty blocks of a bitmap back to the disk. Bits of the runs in
+ * freed, if any, are written clear whatever they are in memory.
+ */
+static void bitmap_write(bitmap_t b, char *dirty, int start_blk, int nblocks, const struct block_runs *freed) {
+	bitmap_t copy = NULL;
+	for(int k = 0; k < nblocks; k++){
+		if(!dirty[k]){
+			continue;
+		}
+		bitmap_t data = b + (size_t) k * BLOCK_SIZE;
+		int first = k * 8 * BLOCK_SIZE, last = first + 8 * BLOCK_SIZE;
+		for(int i = 0; freed != NULL && i < freed->count; i++){
+			int from = freed->runs[i].pblk, to = from + freed->runs[i].len;
+			if(to <= first || from >= last){
+				continue;
+			}
+			if(data != copy){
+				copy = copy != NULL ? copy : malloc(BLOCK_SIZE);
+				memcpy(copy, data, BLOCK_SIZE);
+				data = copy;
+			}
+			for(int bit = from > first ? from : first; bit < to && bit < last; bit++){
+				unset_bitmap(copy, bit - first);
+			}
+		}
+		bio_write(start_blk + k, data);
+		dirty[k] = 0;
+	}
+	free(copy);
+}
+
+/*
+ * Write the blocks of the in-memory bitmaps that changed back to the disk.
+ * Blocks freed in the running transaction go out free, so that they are
+ * free once it commits, though nothing may take them before that.
  */
-int readi(uint16_t ino, struct inode *inode) {
+int bitmap_sync() {
+	pthread_mutex_lock(&discard_lock);
+	struct block_runs freed = { NULL, 0, 0 };
+	for(int i = 0; i < free_freed.count; i++){
+		block_runs_add(&freed, free_freed.runs[i].pblk, free_freed.runs[i].len);
+	}
+	pthread_mutex_unlock(&discard_lock);
+
+	for(int g = 0; g < ngroups; g++){
+		pthread_mutex_lock(&groups[g].lock);
+	}
+	for(int i = 0; i < freed.count; i++){
+		bitmap_touch(d_bmap_dirty, freed.runs[i].pblk, freed.runs[i].len);
+	}
+	bitmap_write(i_bmap, i_bmap_dirty, superblock->i_bitmap_blk, i_bmap_blocks, NULL);
+	bitmap_write(d_bmap, d_bmap_dirty, superblock->d_bitmap_blk, d_bmap_blocks, &freed);
+	for(int g = ngroups - 1; g >= 0; g--){
+		pthread_mutex_unlock(&groups[g].lock);
+	}
+	block_runs_clear(&freed);
+	return 0;
+}
+
+// What the dentry cache knows about a freed inode goes with it, see below
+void dcache_forget_ino(uint32_t ino);
+
+/*
+ * Return an inode number obtained from get_avail_ino() to the bitmap
+ */
+void free_ino(int ino) {
+	struct alloc_group *grp = &groups[group_of_ino(ino)];
+	int freed = 0;
+	pthread_mutex_lock(&grp->lock);
+	if(get_bitmap(i_bmap, ino)){
+		unset_bitmap(i_bmap, ino);
+		grp->i_free++;
+		bitmap_touch(i_bmap_dirty, ino, 1);
+		freed = 1;
+	}
+	pthread_mutex_unlock(&grp->lock);
+	if(freed){
+		pthread_mutex_lock(&alloc_lock);
+		i_free++;
+		pthread_mutex_unlock(&alloc_lock);
+		dcache_forget_ino(ino);
+	}
+}
+
+/*
+ * Allocate group g's next inode table chunk from the data region, near the
+ * group's own blocks, and open its inodes up in the bitmap. Chunks only
+ * ever get added, under itable_lock, inside the caller's transaction.
+ * Returns 0, even if the group had no chunk left to add, or -1 if there is
+ * no run of free blocks long enough.
+ */
+static int inode_grow(int g) {
+	struct alloc_group *grp = &groups[g];
+	uint32_t per_chunk = superblock->i_chunk_inodes;
+	int want = (size_t) per_chunk * superblock->inode_size / BLOCK_SIZE;
+	pthread_mutex_lock(&itable_lock);
+	if(grp->i_unmapped == 0){
+		pthread_mutex_unlock(&itable_lock);
+		return 0;
+	}
+
+	// Step 1: The group's first chunk not there yet
+	uint32_t c = g * superblock->group_inodes / per_chunk;
+	while(superblock->i_chunk_blk[c] != 0){
+		c++;
+	}
+
+	// Step 2: One contiguous run for it, reading as free inodes
+	int got;
+	int blk = get_avail_blkno_run(inode_goal(c * per_chunk), want, &got);
+	if(blk < 0 || got < want){
+		if(blk >= 0){
+			free_blkno_run(blk, got);
+		}
+		pthread_mutex_unlock(&itable_lock);
+		return -1;
+	}
+	// The zeros go straight to the disk file and are made durable ahead of
+	// the commit that maps the chunk, so only the superblock and bitmap are
+	// logged
+	if(bio_zero(blk, want) < 0 || dev_barrier() < 0){
+		free_blkno_run(blk, want);
+		pthread_mutex_unlock(&itable_lock);
+		return -1;
+	}
+
+	// Step 3: Map it in the superblock, then free its inodes in the bitmap
+	superblock->i_chunk_blk[c] = blk;
+	bio_write(0, superblock);
+	int first = c * per_chunk;
+	pthread_mutex_lock(&grp->lock);
+	for(uint32_t i = 0; i < per_chunk; i++){
+		unset_bitmap(i_bmap, first + i);
+	}
+	bitmap_touch(i_bmap_dirty, first, per_chunk);
+	grp->i_free += per_chunk;
+	grp->i_cursor = first - g * superblock->group_inodes;
+	__atomic_store_n(&grp->i_unmapped, grp->i_unmapped - per_chunk, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&grp->lock);
+	pthread_mutex_lock(&alloc_lock);
+	i_free += per_chunk;
+	pthread_mutex_unlock(&alloc_lock);
+	pthread_mutex_unlock(&itable_lock);
+	return 0;
+}
+
+/*
+ * Get an available inode number for a new file or directory in directory
+ * parent_ino, or -1 if there is none
+ */
+int get_avail_ino_near(int parent_ino, int dir) {
+
+	// Step 1: Files start in the parent's group, directories wherever there
+	// is room. A group out of inodes grows its table before the file is
+	// sent elsewhere
+	int start = parent_ino >= 0 ? group_of_ino(parent_ino) : 0;
+	if(dir){
+		start = find_group_dir(start);
+	}
+	if(__atomic_load_n(&groups[start].i_free, __ATOMIC_RELAXED) == 0){
+		inode_grow(start);
+	}
+
+	// Step 2: Take one from the free count, so some group is sure to have
+	// it. When every table chunk is full, add one in the first group from
+	// start with room for it
+	pthread_mutex_lock(&alloc_lock);
+	while(i_free == 0){
+		pthread_mutex_unlock(&alloc_lock);
+		int n = 0;
+		while(n < ngroups && __atomic_load_n(&groups[(start + n) % ngroups].i_unmapped, __ATOMIC_RELAXED) == 0){
+			n++;
+		}
+		if(n == ngroups || inode_grow((start + n) % ngroups) < 0){
+			return -1;
+		}
+		pthread_mutex_lock(&alloc_lock);
+	}
+	i_free--;
+	pthread_mutex_unlock(&alloc_lock);
+
+	// Step 3: Traverse the group inode bitmaps a word at a time to find an
+	// available slot. A group passed over may be refilled by a free while
+	// another allocation empties the one ahead, so keep going round
+	int ino = -1;
+	for(int n = 0; ino < 0; n++){
+		ino = group_alloc_ino((start + n) % ngroups);
+	}
+	return ino;
+}
+
+/* 
+ * Get available inode number from bitmap
+ */
+int get_avail_ino() {
+	return get_avail_ino_near(-1, 0);
+}
+
+/* 
+ * extent tree operations
+ */
+
+//Index of the last record starting at or before lblk (0 if lblk precedes them all)
+static int extent_search(struct extent *recs, int count, uint32_t lblk) {
+	int lo = 0, hi = count - 1;
+	while(lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		if(recs[mid].lblk <= lblk){
+			lo = mid;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Map logical block lblk of inode. Returns the physical block, or 0 for a
+ * hole, and sets *run to how many following blocks stay contiguous (for a
+ * hole, how many blocks until the next mapped one).
+ */
+uint32_t extent_lookup(struct inode *inode, uint32_t lblk, uint32_t *run) {
+	struct extent_header *hdr = &inode->ext_hdr;
+	struct extent *recs = inode->extents;
+	int node_blk = -1;
+	uint32_t pblk = 0;
+	uint32_t hole = UINT32_MAX;
+
+	// Tree nodes are examined in place, only the current one is held
+	while(hdr->count > 0 && hdr->depth > 0){
+		int i = extent_search(recs, hdr->count, lblk);
+		if(i + 1 < hdr->count){
+			hole = recs[i + 1].lblk - lblk;
+		}
+		int child_blk = recs[i].pblk;
+		hdr = bio_get(child_blk);
+		recs = (struct extent *) (hdr + 1);
+		if(node_blk >= 0){
+			bio_put(node_blk, 0);
+		}
+		node_blk = child_blk;
+	}
+
+	if(hdr->count > 0){
+		int i = extent_search(recs, hdr->count, lblk);
+		if(recs[i].lblk <= lblk && lblk < recs[i].lblk + recs[i].len){
+			pblk = recs[i].pblk + (lblk - recs[i].lblk);
+			hole = recs[i].len - (lblk - recs[i].lblk);
+		}
+		else if(recs[i].lblk > lblk){
+			hole = recs[i].lblk - lblk;
+		}
+		else if(i + 1 < hdr->count && recs[i + 1].lblk - lblk < hole){
+			hole = recs[i + 1].lblk - lblk;
+		}
+	}
+	if(run != NULL){
+		*run = hole;
+	}
+	if(node_blk >= 0){
+		bio_put(node_blk, 0);
+	}
+	return pblk;
+}
+
+/*
+ * Add ext to the leaf node recs, merging it into a neighbouring extent when
+ * both the logical and physical ranges line up. The node must have room.
+ */
+static void extent_leaf_insert(struct extent_header *hdr, struct extent *recs, struct extent *ext) {
+	if(hdr->count > 0){
+		int i = extent_search(recs, hdr->count, ext->lblk);
+		if(recs[i].lblk <= ext->lblk){
+			if(recs[i].lblk + recs[i].len == ext->lblk && recs[i].pblk + recs[i].len == ext->pblk){
+				recs[i].len += ext->len;
+				return;
+			}
+			i++;
+		}
+		if(i < hdr->count && ext->lblk + ext->len == recs[i].lblk && ext->pblk + ext->len == recs[i].pblk){
+			recs[i].lblk = ext->lblk;
+			recs[i].pblk = ext->pblk;
+			recs[i].len += ext->len;
+			return;
+		}
+		memmove(&recs[i + 1], &recs[i], (hdr->count - i) * sizeof(struct extent));
+		recs[i] = *ext;
+	}
+	else {
+		recs[0] = *ext;
+	}
+	hdr->count++;
+}
+
+// New tree nodes come out of what was reserved for the inode's pending
+// blocks first, see delayed allocation below
+static int extent_node_alloc(struct inode *inode, int goal);
+
+/*
+ * Insert a mapping for len blocks at lblk -> pblk into inode's extent tree.
+ * Full nodes are split on the way down so there is always room below.
+ * Returns 0, or -1 if no block is left for a new tree node.
+ */
+int extent_insert(struct inode *inode, uint32_t lblk, uint32_t pblk, uint32_t len) {
+	struct extent ext = { lblk, pblk, len };
+	struct extent_header *hdr = &inode->ext_hdr;
+	struct extent *recs = inode->extents;
+
+	// Step 1: A full root moves down into a new block and gains a level
+	if(hdr->count == INODE_EXTENTS(superblock->inode_size)){
+		int blk = extent_node_alloc(inode, inode_goal(inode->ino));
+		if(blk < 0){
+			return -1;
+		}
+		char *node = calloc(1, BLOCK_SIZE);
+		memcpy(node, hdr, sizeof(struct extent_header));
+		memcpy(node + sizeof(struct extent_header), recs, hdr->count * sizeof(struct extent));
+		bio_write(blk, node);
+		free(node);
+		recs[0].lblk = 0;
+		recs[0].pblk = blk;
+		recs[0].len = 0;
+		hdr->count = 1;
+		hdr->depth++;
+		inode->blocks++;
+	}
+
+	// Step 2: Walk down to the leaf, splitting any full child first
+	char *buf_a = malloc(BLOCK_SIZE);
+	char *buf_b = malloc(BLOCK_SIZE);
+	char *spare = malloc(BLOCK_SIZE);
+	int node_blk = -1;
+	int ret = 0;
+	while(hdr->depth > 0){
+		int i = extent_search(recs, hdr->count, lblk);
+		int child_blk = recs[i].pblk;
+		char *child = (char *) hdr == buf_a ? buf_b : buf_a;
+		bio_read(child_blk, child);
+		struct extent_header *chdr = (struct extent_header *) child;
+		struct extent *crecs = (struct extent *) (chdr + 1);
+
+		if(chdr->count == EXTENT_NODE_MAX){
+			int new_blk = extent_node_alloc(inode, child_blk + 1);
+			if(new_blk < 0){
+				ret = -1;
+				break;
+			}
+			int half = chdr->count / 2;
+			struct extent_header *shdr = (struct extent_header *) spare;
+			memset(spare, 0, BLOCK_SIZE);
+			shdr->depth = chdr->depth;
+			shdr->count = chdr->count - half;
+			memcpy(shdr + 1, &crecs[half], shdr->count * sizeof(struct extent));
+			chdr->count = half;
+			bio_write(new_blk, spare);
+			bio_write(child_blk, child);
+			inode->blocks++;
+
+			// The parent has room: it was split itself on the way down if it was full
+			memmove(&recs[i + 2], &recs[i + 1], (hdr->count - i - 1) * sizeof(struct extent));
+			recs[i + 1].lblk = ((struct extent *) (shdr + 1))->lblk;
+			recs[i + 1].pblk = new_blk;
+			recs[i + 1].len = 0;
+			hdr->count++;
+			if(node_blk >= 0){
+				bio_write(node_blk, hdr);
+			}
+			if(lblk >= recs[i + 1].lblk){
+				// Descend into the new sibling and recycle the left half's buffer
+				child_blk = new_blk;
+				if(child == buf_a){
+					buf_a = spare;
+				}
+				else {
+					buf_b = spare;
+				}
+				spare = child;
+				child = (char *) shdr;
+			}
+		}
+
+		node_blk = child_blk;
+		hdr = (struct extent_header *) child;
+		recs = (struct extent *) (hdr + 1);
+	}
+
+	// Step 3: Insert into the leaf and write it back
+	if(ret == 0){
+		extent_leaf_insert(hdr, recs, &ext);
+		if(node_blk >= 0){
+			bio_write(node_blk, hdr);
+		}
+	}
+	free(buf_a);
+	free(buf_b);
+	free(spare);
+	return ret;
+}
+
+/*
+ * Drop the mappings of logical blocks [start, end) below node hdr, adding
+ * the blocks they covered and any tree node left empty to freed. An extent
+ * reaching past both ends keeps only its part before start; extent_remove()
+ * has inserted the part after end already. Returns whether hdr changed.
+ */
+static int extent_node_remove(struct inode *inode, struct extent_header *hdr, struct extent *recs,
+		uint32_t start, uint32_t end, struct block_runs *freed) {
+	int changed = 0;
+
+	// Leaf: trim or drop each extent that overlaps the range
+	if(hdr->depth == 0){
+		for(int i = 0; i < hdr->count; ){
+			struct extent *ext = &recs[i];
+			uint32_t ext_end = ext->lblk + ext->len;
+			if(ext_end <= start || ext->lblk >= end){
+				i++;
+				continue;
+			}
+			uint32_t lo = ext->lblk > start ? ext->lblk : start;
+			uint32_t hi = ext_end < end ? ext_end : end;
+			block_runs_add(freed, ext->pblk + (lo - ext->lblk), hi - lo);
+			inode->blocks -= hi - lo;
+			changed = 1;
+			if(ext->lblk < start){
+				ext->len = start - ext->lblk;
+				i++;
+			}
+			else if(ext_end > end){
+				ext->pblk += end - ext->lblk;
+				ext->len = ext_end - end;
+				ext->lblk = end;
+				i++;
+			}
+			else {
+				memmove(ext, ext + 1, (hdr->count - i - 1) * sizeof(struct extent));
+				hdr->count--;
+			}
+		}
+		return changed;
+	}
+
+	// Index: a child covers the keys from its own up to the next one's.
+	// Children emptied out are freed and their copies in the journal revoked
+	char *child = malloc(BLOCK_SIZE);
+	for(int i = 0; i < hdr->count; ){
+		if(recs[i].lblk >= end){
+			break;
+		}
+		if(i + 1 < hdr->count && recs[i + 1].lblk <= start){
+			i++;
+			continue;
+		}
+		int child_blk = recs[i].pblk;
+		bio_read(child_blk, child);
+		struct extent_header *chdr = (struct extent_header *) child;
+		if(extent_node_remove(inode, chdr, (struct extent *) (chdr + 1), start, end, freed)){
+			if(chdr->count == 0){
+				journal_revoke(child_blk);
+				block_runs_add(freed, child_blk, 1);
+				inode->blocks--;
+				memmove(&recs[i], &recs[i + 1], (hdr->count - i - 1) * sizeof(struct extent));
+				hdr->count--;
+				changed = 1;
+				continue;
+			}
+			bio_write(child_blk, child);
+		}
+		i++;
+	}
+	free(child);
+	return changed;
+}
+
+/*
+ * Unmap logical blocks [start, end) of inode and free the blocks behind
+ * them, along with the tree nodes that end up empty. Returns 0, or -1 if
+ * an extent had to be split in two and no block was left for the tree.
+ */
+int extent_remove(struct inode *inode, uint32_t start, uint32_t end) {
+	struct block_runs freed = { NULL, 0, 0 };
+
+	// Step 1: Punching into the middle of an extent leaves two of them; the
+	// part after end is mapped on its own first
+	if(start > 0 && end != UINT32_MAX){
+		uint32_t run;
+		uint32_t pblk = extent_lookup(inode, start - 1, &run);
+		if(pblk != 0 && run > end - start + 1){
+			uint32_t skip = end - start + 1;
+			if(extent_insert(inode, end, pblk + skip, run - skip) != 0){
+				return -1;
+			}
+		}
+	}
+
+	// Step 2: Trim the tree from the root down. A root left without
+	// children is a leaf again
+	struct extent_header *hdr = &inode->ext_hdr;
+	extent_node_remove(inode, hdr, inode->extents, start, end, &freed);
+	if(hdr->count == 0){
+		hdr->depth = 0;
+	}
+
+	// Step 3: One bitmap pass per run, in block order
+	block_runs_free(&freed);
+	return 0;
+}
+
+/* 
+ * inode cache
+ *
+ * In-memory copies of on-disk inodes, hashed by inode number. iget() pins
+ * an inode and iput() releases it; only unpinned inodes are recycled, least
+ * recently used first. Modified inodes are marked dirty and written back by
+ * inode_sync(), which groups them by inode table block so every block is
+ * read and written once no matter how many of its inodes changed.
+ *
+ * icache_lock guards the table, LRU list, pin counts and dirty flags. The
+ * contents of a pinned inode are guarded by its own reader/writer lock,
+ * taken with irdlock()/iwrlock(); for a directory that lock also covers its
+ * data blocks and hash index. iget() drops icache_lock to read an inode in
+ * or write an evicted one back; the entry is marked busy meanwhile and
+ * lookups of it wait on icache_cond.
+ */
+#define ICACHE_NHASH 1031
+#define ICACHE_MAX 4096
+
+struct pending_block {
+	uint32_t lblk;						/* logical block of the file */
+	char *data;							/* its contents, BLOCK_SIZE bytes */
+};
+
+struct icache_entry {
+	struct inode inode;					/* must stay first, see ientry() */
+	int refcnt;							/* pins held through iget() */
+	int dirty;							/* differs from the inode table */
+	int busy;							/* being read in or written back by iget() */
+	pthread_rwlock_t lock;				/* guards inode and, for directories, entries */
+	struct pending_block *pending;		/* blocks awaiting allocation, by lblk */
+	int npending, pending_cap;
+	int tree_reserved;					/* extent tree blocks reserved for placing them */
+	struct icache_entry *hnext;			/* hash chain */
+	struct icache_entry *prev, *next;	/* LRU list of unpinned entries */
+};
+
+struct icache_entry *icache_tbl[ICACHE_NHASH];
+struct icache_entry icache_lru = { .prev = &icache_lru, .next = &icache_lru };
+int icache_count = 0;
+int icache_ndirty = 0;
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t icache_cond = PTHREAD_COND_INITIALIZER;
+
+static inline struct icache_entry *ientry(struct inode *inode) {
+	return (struct icache_entry *) inode;
+}
+
+static inline int inode_blk(uint32_t ino) {
+	uint32_t per_chunk = superblock->i_chunk_inodes;
+	return superblock->i_chunk_blk[ino / per_chunk] + ((size_t) (ino % per_chunk) * superblock->inode_size) / BLOCK_SIZE;
+}
+
+// Byte offset of inode ino's record in its inode table block
+static inline int inode_off(uint32_t ino) {
+	return (ino % (BLOCK_SIZE / superblock->inode_size)) * superblock->inode_size;
+}
+
+/*
+ * Convert between an inode table record and the in-memory inode
+ */
+static void inode_load(struct inode *inode, const struct dinode *d) {
+	memset(inode, 0, sizeof(struct inode));
+	inode->valid = d->version != 0 ? VALID : 0;
+	inode->flags = d->flags;
+	inode->size = d->size;
+	inode->mode = d->mode;
+	inode->link = d->links;
+	inode->uid = d->uid;
+	inode->gid = d->gid;
+	inode->blocks = d->blocks;
+	inode->dir_index = d->dir_index;
+	inode->atime = d->atime;
+	inode->mtime = d->mtime;
+	inode->ctime = d->ctime;
+	memcpy(inode->inline_data, d->i_block, INODE_IBLOCK(superblock->inode_size));
+}
+
+static void inode_store(struct dinode *d, const struct inode *inode) {
+	memset(d, 0, superblock->inode_size);
+	if(!inode->valid){
+		return;
+	}
+	d->version = DINODE_VERSION;
+	d->flags = inode->flags;
+	d->size = inode->size;
+	d->mode = inode->mode;
+	d->links = inode->link;
+	d->uid = inode->uid;
+	d->gid = inode->gid;
+	d->blocks = inode->blocks;
+	d->dir_index = inode->dir_index;
+	d->atime = __atomic_load_n(&inode->atime, __ATOMIC_RELAXED);
+	d->mtime = inode->mtime;
+	d->ctime = inode->ctime;
+	memcpy(d->i_block, inode->inline_data, INODE_IBLOCK(superblock->inode_size));
+}
+
+static void icache_lru_unlink(struct icache_entry *e) {
+	if(e->next != NULL){
+		e->prev->next = e->next;
+		e->next->prev = e->prev;
+		e->prev = e->next = NULL;
+	}
+}
+
+static void icache_lru_push(struct icache_entry *e) {
+	e->next = icache_lru.next;
+	e->prev = &icache_lru;
+	icache_lru.next->prev = e;
+	icache_lru.next = e;
+}
+
+static void icache_unhash(struct icache_entry *e) {
+	struct icache_entry **pp = &icache_tbl[e->inode.ino % ICACHE_NHASH];
+	while(*pp != e){
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+}
+
+static int cmp_ientry_ino(const void *a, const void *b) {
+	return (*(struct icache_entry **) a)->inode.ino - (*(struct icache_entry **) b)->inode.ino;
+}
+
+/*
+ * delayed allocation
+ *
+ * A write into a hole does not pick a disk block right away. The data waits
+ * in memory with the cached inode and only a free block is reserved for it,
+ * so the write still fails with ENOSPC when it should. Each run of pending
+ * blocks also reserves the extent tree blocks its mapping may need, so
+ * placing it does not fail for lack of them either. When the file is
+ * flushed or released, its last pin is dropped or DELALLOC_MAX_BLOCKS are
+ * waiting, they all get one contiguous allocation and one vectored write,
+ * so files appended to in turns still end up in long extents. Once
+ * DELALLOC_TOTAL_BLOCKS wait across all files, writers place their own
+ * before adding more, and each journal commit places what it can of the
+ * rest. The pending blocks are guarded by the inode's lock like the rest
+ * of it.
+ */
+
+int delalloc_total = 0;		//blocks pending in all files
+
+// Index of the first pending block at or after lblk
+static int delalloc_search(struct icache_entry *e, uint32_t lblk) {
+	int lo = 0, hi = e->npending;
+	while(lo < hi){
+		int mid = (lo + hi) / 2;
+		if(e->pending[mid].lblk < lblk){
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Contents of logical block lblk if it is waiting for allocation, else NULL
+ */
+static char *delalloc_find(struct inode *inode, uint32_t lblk) {
+	struct icache_entry *e = ientry(inode);
+	int i = delalloc_search(e, lblk);
+	return i < e->npending && e->pending[i].lblk == lblk ? e->pending[i].data : NULL;
+}
+
+static int extent_node_alloc(struct inode *inode, int goal) {
+	struct icache_entry *e = ientry(inode);
+	if(e->tree_reserved > 0){
+		int got;
+		e->tree_reserved--;
+		return get_reserved_blkno_run(goal, 1, &got);
+	}
+	return get_avail_blkno_near(goal);
+}
+
+// Extent tree blocks one more extent of inode may take: a split on every
+// level and a new root level
+static inline int delalloc_tree_need(struct inode *inode) {
+	return inode->ext_hdr.depth + 2;
+}
+
+// Return the tree blocks reserved for inode once nothing is pending
+static void delalloc_release_tree(struct icache_entry *e) {
+	if(e->npending == 0 && e->tree_reserved > 0){
+		unreserve_blkno(e->tree_reserved);
+		e->tree_reserved = 0;
+	}
+}
+
+/*
+ * Place every pending block of inode on disk. Called with the inode's lock
+ * held for writing; the caller marks the inode dirty. Returns 0, or -1 if
+ * some could not be mapped after all, in which case they stay pending with
+ * their reservations.
+ */
+static int delalloc_flush(struct inode *inode) {
+	struct icache_entry *e = ientry(inode);
+	int count = e->npending;
+	if(count == 0){
+		return 0;
+	}
+	int* blocks = malloc(count * sizeof(int));
+	const void** bufs = malloc(count * sizeof(void*));
+
+	// Step 1: Allocate right after the block before the first pending one,
+	// in as few runs as the free space allows. The blocks were reserved, so
+	// this cannot come up short
+	struct pending_block *pending = e->pending;
+	uint32_t prev = pending[0].lblk > 0 ? extent_lookup(inode, pending[0].lblk - 1, NULL) : 0;
+	int goal = prev != 0 ? prev + 1 : inode_goal(inode->ino);
+	for(int done = 0; done < count; ){
+		int got;
+		int block = get_reserved_blkno_run(goal, count - done, &got);
+		for(int k = 0; k < got; k++){
+			blocks[done + k] = block + k;
+			bufs[done + k] = pending[done + k].data;
+		}
+		done += got;
+		goal = block + got;
+	}
+
+	// Step 2: Map them, one extent per logically and physically contiguous
+	// run. A run that cannot be mapped gives its blocks back to the
+	// reservation and stays pending
+	int ret = 0;
+	for(int i = 0; i < count; ){
+		int run = 1;
+		while(i + run < count && pending[i + run].lblk == pending[i].lblk + run && blocks[i + run] == blocks[i] + run){
+			run++;
+		}
+		if(extent_insert(inode, pending[i].lblk, blocks[i], run) != 0){
+			unclaim_blkno_run(blocks[i], run);
+			for(int k = 0; k < run; k++){
+				blocks[i + k] = 0;
+			}
+			ret = -1;
+		}
+		i += run;
+	}
+
+	// Step 3: Write them out, contiguous blocks merge into single writes
+	int n = 0, kept = 0;
+	for(int i = 0; i < count; i++){
+		if(blocks[i] != 0){
+			blocks[n] = blocks[i];
+			bufs[n++] = bufs[i];
+		}
+	}
+	bio_writev(blocks, bufs, n);
+	for(int i = 0, j = 0; i < count; i++){
+		if(j < n && bufs[j] == pending[i].data){
+			free(pending[i].data);
+			j++;
+		}
+		else {
+			pending[kept++] = pending[i];
+		}
+	}
+	e->npending = kept;
+	__atomic_sub_fetch(&delalloc_total, count - kept, __ATOMIC_RELAXED);
+	delalloc_release_tree(e);
+	free(bufs);
+	free(blocks);
+	return ret;
+}
+
+/*
+ * Contents of logical block lblk to write into, for a block in a hole. A
+ * block not yet pending is added zero filled, first flushing the others if
+ * DELALLOC_MAX_BLOCKS are already waiting, or DELALLOC_TOTAL_BLOCKS in all
+ * files. Called with the inode's lock held for writing. Returns NULL if no
+ * block is left to reserve, for it or for the tree blocks to map it.
+ */
+static char *delalloc_block(struct inode *inode, uint32_t lblk) {
+	struct icache_entry *e = ientry(inode);
+	int i = delalloc_search(e, lblk);
+	if(i < e->npending && e->pending[i].lblk == lblk){
+		return e->pending[i].data;
+	}
+
+	if(e->npending >= DELALLOC_MAX_BLOCKS || __atomic_load_n(&delalloc_total, __ATOMIC_RELAXED) >= DELALLOC_TOTAL_BLOCKS){
+		delalloc_flush(inode);
+		i = delalloc_search(e, lblk);
+	}
+
+	// A block that does not extend a pending run starts a new extent
+	int tree = i == 0 || e->pending[i - 1].lblk != lblk - 1 ? delalloc_tree_need(inode) : 0;
+	if(reserve_blkno(1 + tree) != 0){
+		return NULL;
+	}
+	e->tree_reserved += tree;
+	if(e->npending == e->pending_cap){
+		e->pending_cap = e->pending_cap > 0 ? 2 * e->pending_cap : 16;
+		e->pending = realloc(e->pending, e->pending_cap * sizeof(struct pending_block));
+	}
+	memmove(&e->pending[i + 1], &e->pending[i], (e->npending - i) * sizeof(struct pending_block));
+	e->pending[i].lblk = lblk;
+	e->pending[i].data = calloc(1, BLOCK_SIZE);
+	e->npending++;
+	__atomic_add_fetch(&delalloc_total, 1, __ATOMIC_RELAXED);
+	inode->blocks++;
+	return e->pending[i].data;
+}
+
+/*
+ * Forget the pending blocks of inode in [first, last) along with their
+ * reservations. Called with the inode's lock held for writing.
+ */
+static void delalloc_drop(struct inode *inode, uint32_t first, uint32_t last) {
+	struct icache_entry *e = ientry(inode);
+	int i = delalloc_search(e, first);
+	int n = 0;
+	while(i + n < e->npending && e->pending[i + n].lblk < last){
+		free(e->pending[i + n].data);
+		n++;
+	}
+	if(n == 0){
+		return;
+	}
+	memmove(&e->pending[i], &e->pending[i + n], (e->npending - i - n) * sizeof(struct pending_block));
+	e->npending -= n;
+	__atomic_sub_fetch(&delalloc_total, n, __ATOMIC_RELAXED);
+	inode->blocks -= n;
+	unreserve_blkno(n);
+	delalloc_release_tree(e);
+}
+
+/*
+ * Write every dirty cached inode back to the inode table. An inode whose
+ * lock is held for writing is being changed right now; it stays dirty and
+ * goes out with the next sync. One that iget() is writing back already is
+ * left to it.
+ */
+int inode_sync() {
+	// Step 1: Pin the dirty inodes and hold them still, so their table
+	// blocks can be patched once icache_lock is dropped. A change made after
+	// this marks its inode dirty again
+	pthread_mutex_lock(&icache_lock);
+	if(icache_ndirty == 0){
+		pthread_mutex_unlock(&icache_lock);
+		return 0;
+	}
+	struct icache_entry **dirty = malloc(icache_ndirty * sizeof(struct icache_entry *));
+	int ndirty = 0;
+	for(int h = 0; h < ICACHE_NHASH; h++){
+		for(struct icache_entry *e = icache_tbl[h]; e != NULL; e = e->hnext){
+			if(e->dirty && !e->busy && pthread_rwlock_tryrdlock(&e->lock) == 0){
+				icache_lru_unlink(e);
+				e->refcnt++;
+				e->dirty = 0;
+				dirty[ndirty++] = e;
+			}
+		}
+	}
+	icache_ndirty -= ndirty;
+	pthread_mutex_unlock(&icache_lock);
+
+	// Step 2: Store them in table order so each block is patched in one pass
+	qsort(dirty, ndirty, sizeof(struct icache_entry *), cmp_ientry_ino);
+	char *table = NULL;
+	int cur_blk = -1;
+	for(int i = 0; i < ndirty; i++){
+		uint32_t ino = dirty[i]->inode.ino;
+		if(inode_blk(ino) != cur_blk){
+			if(cur_blk >= 0){
+				bio_put(cur_blk, 1);
+			}
+			cur_blk = inode_blk(ino);
+			table = bio_get(cur_blk);
+		}
+		inode_store((struct dinode *) (table + inode_off(ino)), &dirty[i]->inode);
+	}
+	if(cur_blk >= 0){
+		bio_put(cur_blk, 1);
+	}
+
+	// Step 3: Unpin them
+	pthread_mutex_lock(&icache_lock);
+	for(int i = 0; i < ndirty; i++){
+		pthread_rwlock_unlock(&dirty[i]->lock);
+		if(--dirty[i]->refcnt == 0){
+			icache_lru_push(dirty[i]);
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	free(dirty);
+	return 0;
+}
+
+/*
+ * Place the pending blocks of every file not in use right now, once half
+ * of DELALLOC_TOTAL_BLOCKS are waiting, or regardless if all is set.
+ * Called by a journal commit, with no operation in flight; a file whose
+ * lock is held anyway is left for the next one.
+ */
+static void delalloc_sync(int all) {
+	if(!all && __atomic_load_n(&delalloc_total, __ATOMIC_RELAXED) < DELALLOC_TOTAL_BLOCKS / 2){
+		return;
+	}
+
+	// Step 1: Pin the files with pending blocks so they stay cached once
+	// icache_lock is dropped
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry **files = NULL;
+	int nfiles = 0, cap = 0;
+	for(int h = 0; h < ICACHE_NHASH; h++){
+		for(struct icache_entry *e = icache_tbl[h]; e != NULL; e = e->hnext){
+			if(e->npending > 0){
+				if(nfiles == cap){
+					cap = cap > 0 ? 2 * cap : 16;
+					files = realloc(files, cap * sizeof(struct icache_entry *));
+				}
+				icache_lru_unlink(e);
+				e->refcnt++;
+				files[nfiles++] = e;
+			}
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+
+	// Step 2: Place their blocks
+	for(int i = 0; i < nfiles; i++){
+		if(pthread_rwlock_trywrlock(&files[i]->lock) == 0){
+			delalloc_flush(&files[i]->inode);
+			pthread_rwlock_unlock(&files[i]->lock);
+		}
+	}
+
+	// Step 3: Unpin them, their inodes changed
+	pthread_mutex_lock(&icache_lock);
+	for(int i = 0; i < nfiles; i++){
+		if(!files[i]->dirty){
+			files[i]->dirty = 1;
+			icache_ndirty++;
+		}
+		if(--files[i]->refcnt == 0){
+			icache_lru_push(files[i]);
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	free(files);
+}
+
+/*
+ * Drop every cached inode, after writing back the dirty ones
+ */
+void icache_destroy() {
+	delalloc_sync(1);
+	inode_sync();
+	pthread_mutex_lock(&icache_lock);
+	for(int h = 0; h < ICACHE_NHASH; h++){
+		struct icache_entry *e = icache_tbl[h];
+		while(e != NULL){
+			struct icache_entry *next = e->hnext;
+			if(e->npending > 0){
+				fprintf(stderr, "rufs: no room to map %d blocks of inode %u, dropping them\n", e->npending, e->inode.ino);
+				for(int i = 0; i < e->npending; i++){
+					free(e->pending[i].data);
+				}
+			}
+			pthread_rwlock_destroy(&e->lock);
+			free(e->pending);
+			free(e);
+			e = next;
+		}
+		icache_tbl[h] = NULL;
+	}
+	icache_lru.prev = icache_lru.next = &icache_lru;
+	icache_count = 0;
+	icache_ndirty = 0;
+	delalloc_total = 0;
+	pthread_mutex_unlock(&icache_lock);
+}
+
+/*
+ * Write one evicted inode back to the inode table, with icache_lock dropped.
+ * The entry is busy meanwhile, so lookups of it wait rather than read the
+ * table before it is up to date.
+ */
+static void icache_writeback(struct icache_entry *e) {
+	e->busy = 1;
+	pthread_mutex_unlock(&icache_lock);
+	uint32_t ino = e->inode.ino;
+	char *table = bio_get(inode_blk(ino));
+	inode_store((struct dinode *) (table + inode_off(ino)), &e->inode);
+	bio_put(inode_blk(ino), 1);
+	pthread_mutex_lock(&icache_lock);
+	if(e->dirty){
+		e->dirty = 0;
+		icache_ndirty--;
+	}
+	e->busy = 0;
+	pthread_cond_broadcast(&icache_cond);
+}
+
+/*
+ * Get a pinned pointer to the cached copy of inode ino
+ */
+struct inode *iget(uint32_t ino) {
+	pthread_mutex_lock(&icache_lock);
+	struct icache_entry *e;
+	while(1){
+		// Step 1: Look it up, waiting while it is read in or written back
+		e = icache_tbl[ino % ICACHE_NHASH];
+		while(e != NULL && e->inode.ino != ino){
+			e = e->hnext;
+		}
+		if(e != NULL && e->busy){
+			pthread_cond_wait(&icache_cond, &icache_lock);
+			continue;
+		}
+		if(e != NULL){
+			break;
+		}
+
+		// Step 2: Recycle the least recently used unpinned entry once the
+		// cache is full, passing over any that still hold data awaiting
+		// allocation. A dirty one is written back first, after which ino
+		// may have been cached by somebody else, so look again.
+		struct icache_entry *victim = NULL;
+		if(icache_count >= ICACHE_MAX){
+			victim = icache_lru.prev;
+			while(victim != &icache_lru && (victim->npending > 0 || victim->busy)){
+				victim = victim->prev;
+			}
+			if(victim == &icache_lru){
+				victim = NULL;
+			}
+		}
+		if(victim != NULL && victim->dirty){
+			icache_writeback(victim);
+			continue;
+		}
+		if(victim != NULL){
+			e = victim;
+			icache_lru_unlink(e);
+			icache_unhash(e);
+			pthread_rwlock_destroy(&e->lock);
+			free(e->pending);
+		}
+		else {
+			e = malloc(sizeof(struct icache_entry));
+			icache_count++;
+		}
+
+		// Step 3: Hash it busy and pinned, then read the inode in with
+		// icache_lock dropped
+		memset(e, 0, sizeof(struct icache_entry));
+		pthread_rwlock_init(&e->lock, NULL);
+		e->inode.ino = ino;
+		e->busy = 1;
+		e->refcnt = 1;
+		e->hnext = icache_tbl[ino % ICACHE_NHASH];
+		icache_tbl[ino % ICACHE_NHASH] = e;
+		pthread_mutex_unlock(&icache_lock);
+
+		uint64_t rec[INODE_SIZE_MAX / sizeof(uint64_t)];
+		char *table = bio_get(inode_blk(ino));
+		memcpy(rec, table + inode_off(ino), superblock->inode_size);
+		bio_put(inode_blk(ino), 0);
+
+		pthread_mutex_lock(&icache_lock);
+		inode_load(&e->inode, (struct dinode *) rec);
+		e->inode.ino = ino;
+		e->busy = 0;
+		pthread_cond_broadcast(&icache_cond);
+		pthread_mutex_unlock(&icache_lock);
+		return &e->inode;
+	}
+
+	icache_lru_unlink(e);
+	e->refcnt++;
+	pthread_mutex_unlock(&icache_lock);
+	return &e->inode;
+}
+
+/*
+ * Release a pointer obtained from iget()
+ */
+void iput(struct inode *inode) {
+	struct icache_entry *e = ientry(inode);
+	pthread_mutex_lock(&icache_lock);
+	if(e->refcnt == 1 && e->npending > 0){
+		// Data awaiting allocation is placed before the last pin goes,
+		// unless the journal has failed and nothing can be placed anymore
+		pthread_mutex_unlock(&icache_lock);
+		if(journal_start() == 0){
+			pthread_rwlock_wrlock(&e->lock);
+			delalloc_flush(inode);
+			pthread_rwlock_unlock(&e->lock);
+			pthread_mutex_lock(&icache_lock);
+			if(!e->dirty){
+				e->dirty = 1;
+				icache_ndirty++;
+			}
+			pthread_mutex_unlock(&icache_lock);
+			journal_stop();
+		}
+		pthread_mutex_lock(&icache_lock);
+	}
+	if(--e->refcnt == 0){
+		icache_lru_push(e);
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+void imark_dirty(struct inode *inode) {
+	struct icache_entry *e = ientry(inode);
+	pthread_mutex_lock(&icache_lock);
+	if(!e->dirty){
+		e->dirty = 1;
+		icache_ndirty++;
+	}
+	pthread_mutex_unlock(&icache_lock);
+}
+
+void irdlock(struct inode *inode) {
+	pthread_rwlock_rdlock(&ientry(inode)->lock);
+}
+
+void iwrlock(struct inode *inode) {
+	pthread_rwlock_wrlock(&ientry(inode)->lock);
+}
+
+void iunlock(struct inode *inode) {
+	pthread_rwlock_unlock(&ientry(inode)->lock);
+}
+
+/* 
+ * inode operations
+ */
+int readi(uint32_t ino, struct inode *inode) {
+
+  	// Step 1: Look the inode up in the inode cache, loading its block on a miss
+	struct inode *cached = iget(ino);
+  	// Step 2: Copy the cached inode out
+	irdlock(cached);
+	memcpy(inode, cached, sizeof(struct inode));
+	iunlock(cached);
+	iput(cached);
+	return 0;
+}
+
+int writei(uint32_t ino, struct inode *inode) {
+
+	// Step 1: Get the cached copy of this inode
+	struct inode *cached = iget(ino);
+	// Step 2: Update it and mark it dirty, inode_sync() writes it to disk
+	iwrlock(cached);
+	memcpy(cached, inode, sizeof(struct inode));
+	cached->ino = ino;
+	iunlock(cached);
+	imark_dirty(cached);
+	iput(cached);
+	return 0;
+}
+
+/*
+ * Fill stbuf from inode, which the caller holds locked. st_blocks is in
+ * 512-byte units like everywhere else.
+ */
+void inode_stat(struct inode *inode, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = inode->ino;
+	stbuf->st_mode = inode->mode;
+	stbuf->st_nlink = inode->link;
+	stbuf->st_uid = inode->uid;
+	stbuf->st_gid = inode->gid;
+	stbuf->st_size = inode->size;
+	stbuf->st_blksize = BLOCK_SIZE;
+	stbuf->st_blocks = (blkcnt_t) inode->blocks * (BLOCK_SIZE / 512);
+	stbuf->st_atime = __atomic_load_n(&inode->atime, __ATOMIC_RELAXED);
+	stbuf->st_mtime = inode->mtime;
+	stbuf->st_ctime = inode->ctime;
+}
+
+
+/* 
+ * dentry cache
+ *
+ * Remembers the result of dir_find() for (parent inode, name) pairs,
+ * including misses (negative entries), so that resolving a path does not
+ * walk directory blocks again. dir_add() and dir_remove() keep the entries
+ * of the directory they modify up to date, and free_ino() drops those of an
+ * inode number that is given back.
+ */
+#define DCACHE_NHASH 4093
+#define DCACHE_MAX 16384
+#define DCACHE_NEGATIVE -1
+
+struct dcache_entry {
+	uint32_t parent;					/* inode number of the directory */
+	int ino;							/* target inode, DCACHE_NEGATIVE if absent */
+	struct dcache_entry *hnext;			/* hash chain */
+	struct dcache_entry *prev, *next;	/* LRU list, head is most recently used */
+	size_t len;							/* length of name */
+	char name[];
+};
+
+struct dcache_entry *dcache_tbl[DCACHE_NHASH];
+struct dcache_entry dcache_lru = { .prev = &dcache_lru, .next = &dcache_lru };
+int dcache_count = 0;
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int dcache_hash(uint32_t parent, const char *name, size_t len) {
+	unsigned int h = 2166136261u ^ parent;
+	for(size_t i = 0; i < len; i++){
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return h % DCACHE_NHASH;
+}
+
+static struct dcache_entry **dcache_slot(uint32_t parent, const char *name, size_t len) {
+	struct dcache_entry **pp = &dcache_tbl[dcache_hash(parent, name, len)];
+	while(*pp != NULL){
+		struct dcache_entry *d = *pp;
+		if(d->parent == parent && d->len == len && memcmp(d->name, name, len) == 0){
+			break;
+		}
+		pp = &d->hnext;
+	}
+	return pp;
+}
+
+static void dcache_unlink(struct dcache_entry **pp) {
+	struct dcache_entry *d = *pp;
+	*pp = d->hnext;
+	d->prev->next = d->next;
+	d->next->prev = d->prev;
+	free(d);
+	dcache_count--;
+}
+
+/*
+ * Look up (parent, name). Returns 1 and sets *ino on a hit (DCACHE_NEGATIVE
+ * if the name is known not to exist), 0 on a miss.
+ */
+int dcache_lookup(uint32_t parent, const char *name, size_t len, int *ino) {
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *d = *dcache_slot(parent, name, len);
+	if(d == NULL){
+		pthread_mutex_unlock(&dcache_lock);
+		return 0;
+	}
+	d->prev->next = d->next;
+	d->next->prev = d->prev;
+	d->next = dcache_lru.next;
+	d->prev = &dcache_lru;
+	dcache_lru.next->prev = d;
+	dcache_lru.next = d;
+	*ino = d->ino;
+	pthread_mutex_unlock(&dcache_lock);
+	return 1;
+}
+
+/*
+ * Record that (parent, name) resolves to ino, or DCACHE_NEGATIVE if it is absent
+ */
+void dcache_insert(uint32_t parent, const char *name, size_t len, int ino) {
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry **pp = dcache_slot(parent, name, len);
+	if(*pp != NULL){
+		dcache_unlink(pp);
+	}
+	if(dcache_count >= DCACHE_MAX){
+		struct dcache_entry *victim = dcache_lru.prev;
+		dcache_unlink(dcache_slot(victim->parent, victim->name, victim->len));
+	}
+
+	struct dcache_entry *d = malloc(sizeof(struct dcache_entry) + len + 1);
+	d->parent = parent;
+	d->ino = ino;
+	d->len = len;
+	memcpy(d->name, name, len);
+	d->name[len] = '\0';
+
+	unsigned int h = dcache_hash(parent, name, len);
+	d->hnext = dcache_tbl[h];
+	dcache_tbl[h] = d;
+	d->next = dcache_lru.next;
+	d->prev = &dcache_lru;
+	dcache_lru.next->prev = d;
+	dcache_lru.next = d;
+	dcache_count++;
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Drop the entries of directory ino and those that resolve to it, once the
+ * inode number is freed and may come back as something else
+ */
+void dcache_forget_ino(uint32_t ino) {
+	pthread_mutex_lock(&dcache_lock);
+	struct dcache_entry *d = dcache_lru.next;
+	while(d != &dcache_lru){
+		struct dcache_entry *next = d->next;
+		if(d->parent == ino || d->ino == (int) ino){
+			dcache_unlink(dcache_slot(d->parent, d->name, d->len));
+		}
+		d = next;
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_destroy() {
+	pthread_mutex_lock(&dcache_lock);
+	while(dcache_lru.next != &dcache_lru){
+		struct dcache_entry *d = dcache_lru.next;
+		dcache_unlink(dcache_slot(d->parent, d->name, d->len));
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* 
+ * directory blocks
+ *
+ * A directory block is a chain of variable-length records covering the
+ * whole block, each rec_len bytes long. A record with type FT_FREE is
+ * unused; a live record only needs DIRENT_LEN(name_len) bytes and any
+ * slack after it can hold the next entry added to the block.
+ */
+
+//Turn a buffer into an empty directory block
+static void dirblk_init(void *block) {
+	struct dirent *d = block;
+	memset(block, 0, BLOCK_SIZE);
+	d->rec_len = BLOCK_SIZE;
+	d->type = FT_FREE;
+}
+
+static inline struct dirent *dirblk_rec(void *block, int off) {
+	return (struct dirent *) ((char *) block + off);
+}
+
+static inline int dirent_match(struct dirent *d, const char *fname, size_t name_len) {
+	return d->type != FT_FREE && d->name_len == name_len && memcmp(d->name, fname, name_len) == 0;
+}
+
+//Look fname up in one directory block
+static int dirblk_find(int blk, const char *fname, size_t name_len, struct dirent *dirent) {
+	char *block = bio_get(blk);
+	struct dirent *d;
+	for(int off = 0; off < BLOCK_SIZE && (d = dirblk_rec(block, off))->rec_len != 0; off += d->rec_len){
+		if(dirent_match(d, fname, name_len)){
+			if(dirent != NULL){
+				memcpy(dirent, d, DIRENT_LEN(d->name_len));
+				dirent->name[d->name_len] = '\0';
+			}
+			bio_put(blk, 0);
+			return 0;
+		}
+	}
+	bio_put(blk, 0);
+	return -1;
+}
+
+/*
+ * Add fname to one directory block, checking for a duplicate in the same pass.
+ * Returns 0 when added, -1 if fname is already there and 1 if the block is full.
+ */
+static int dirblk_add(int blk, uint32_t f_ino, const char *fname, size_t name_len, uint8_t type) {
+	char *block = bio_get(blk);
+	int need = DIRENT_LEN(name_len);
+	int slot = -1;
+	struct dirent *d;
+	for(int off = 0; off < BLOCK_SIZE && (d = dirblk_rec(block, off))->rec_len != 0; off += d->rec_len){
+		if(dirent_match(d, fname, name_len)){
+			bio_put(blk, 0);
+			return -1;
+		}
+		int used = d->type == FT_FREE ? 0 : DIRENT_LEN(d->name_len);
+		if(slot < 0 && d->rec_len - used >= need){
+			slot = off;
+		}
+	}
+	if(slot < 0){
+		bio_put(blk, 0);
+		return 1;
+	}
+
+	// Reuse a free record as is, or carve the new one out of a live record's slack
+	d = dirblk_rec(block, slot);
+	if(d->type != FT_FREE){
+		int used = DIRENT_LEN(d->name_len);
+		struct dirent *n = dirblk_rec(block, slot + used);
+		n->rec_len = d->rec_len - used;
+		d->rec_len = used;
+		d = n;
+	}
+	d->ino = f_ino;
+	d->name_len = name_len;
+	d->type = type;
+	memcpy(d->name, fname, name_len);
+	bio_put(blk, 1);
+	return 0;
+}
+
+//Remove fname from one directory block, merging its record into the previous one
+static int dirblk_remove(int blk, const char *fname, size_t name_len) {
+	char *block = bio_get(blk);
+	struct dirent *d, *prev = NULL;
+	for(int off = 0; off < BLOCK_SIZE && (d = dirblk_rec(block, off))->rec_len != 0; off += d->rec_len){
+		if(dirent_match(d, fname, name_len)){
+			if(prev != NULL){
+				prev->rec_len += d->rec_len;
+			}
+			else {
+				d->type = FT_FREE;
+			}
+			bio_put(blk, 1);
+			return 0;
+		}
+		prev = d;
+	}
+	bio_put(blk, 0);
+	return -1;
+}
+
+//Hash of a name inside a directory index (32-bit FNV-1a)
+static uint32_t dx_hash(const char *name, size_t len) {
+	uint32_t h = 2166136261u;
+	for(size_t i = 0; i < len; i++){
+		h = (h ^ (unsigned char) name[i]) * 16777619u;
+	}
+	return h;
+}
+
+struct hashed_dirent {
+	uint32_t hash;
+	struct dirent *d;
+};
+
+static int cmp_dirent_hash(const void *a, const void *b) {
+	uint32_t ha = ((const struct hashed_dirent *) a)->hash;
+	uint32_t hb = ((const struct hashed_dirent *) b)->hash;
+	return (ha > hb) - (ha < hb);
+}
+
+//Write entries back to back into an empty directory block
+static void dirblk_pack(void *block, struct hashed_dirent *entries, int count) {
+	dirblk_init(block);
+	int off = 0;
+	struct dirent *last = NULL;
+	for(int i = 0; i < count; i++){
+		last = dirblk_rec(block, off);
+		memcpy(last, entries[i].d, DIRENT_LEN(entries[i].d->name_len));
+		last->rec_len = DIRENT_LEN(last->name_len);
+		off += last->rec_len;
+	}
+	if(last != NULL){
+		last->rec_len += BLOCK_SIZE - off;
+	}
+}
+
+/*
+ * Move the upper half (by name hash) of blk's entries into new_blk. Returns
+ * the lowest hash that now lives in new_blk, or 0 if the entries cannot be
+ * split because they all share one hash.
+ */
+static uint32_t dirblk_split(int blk, int new_blk) {
+	char *block = malloc(BLOCK_SIZE);
+	char *out = malloc(BLOCK_SIZE);
+	struct hashed_dirent *entries = malloc((BLOCK_SIZE / DIRENT_LEN(1)) * sizeof(struct hashed_dirent));
+	bio_read(blk, block);
+
+	int count = 0;
+	struct dirent *d;
+	for(int off = 0; off < BLOCK_SIZE && (d = dirblk_rec(block, off))->rec_len != 0; off += d->rec_len){
+		if(d->type != FT_FREE){
+			entries[count].hash = dx_hash(d->name, d->name_len);
+			entries[count].d = d;
+			count++;
+		}
+	}
+	qsort(entries, count, sizeof(struct hashed_dirent), cmp_dirent_hash);
+
+	// Split at the median, moved past entries sharing the median's hash
+	int mid = count / 2;
+	uint32_t split = entries[mid].hash;
+	if(split == entries[0].hash){
+		while(mid < count && entries[mid].hash == entries[0].hash){
+			mid++;
+		}
+		if(mid == count){
+			free(entries);
+			free(out);
+			free(block);
+			return 0;
+		}
+		split = entries[mid].hash;
+	}
+	else {
+		while(mid > 0 && entries[mid - 1].hash == split){
+			mid--;
+		}
+	}
+
+	dirblk_pack(out, &entries[mid], count - mid);
+	bio_write(new_blk, out);
+	dirblk_pack(out, entries, mid);
+	bio_write(blk, out);
+	free(entries);
+	free(out);
+	free(block);
+	return split;
+}
+
+/* 
+ * hashed directory index
+ *
+ * Once a directory outgrows its first block it gets an index block
+ * (dir_index in its inode) mapping ranges of name hashes to leaf blocks.
+ * A name always lives in the leaf whose range covers its hash, so lookup,
+ * insert and remove each read the index plus a single leaf. A full leaf is
+ * split in two by hash and the new range is added to the index.
+ */
+
+//Find the index slot whose hash range contains hash
+static int dx_search(struct dx_root *root, uint32_t hash) {
+	int lo = 0, hi = root->count - 1;
+	while(lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		if(root->entries[mid].hash <= hash){
+			lo = mid;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+//Leaf block holding (or due to hold) fname in an indexed directory
+static int dx_leaf(struct inode *dir_inode, const char *fname, size_t name_len) {
+	struct dx_root *root = bio_get(dir_inode->dir_index);
+	int blk = root->entries[dx_search(root, dx_hash(fname, name_len))].block;
+	bio_put(dir_inode->dir_index, 0);
+	return blk;
+}
+
+/*
+ * Split the full leaf at index slot i, updating the index block root in
+ * place. Returns 0, or -1 if the index is full, the leaf cannot be split or
+ * no block is left.
+ */
+static int dx_split_leaf(struct inode *dir_inode, struct dx_root *root, int i) {
+	if(root->count >= DX_LIMIT){
+		return -1;
+	}
+	int new_blk = get_avail_blkno_near(root->entries[i].block + 1);
+	if(new_blk < 0){
+		return -1;
+	}
+	uint32_t split = dirblk_split(root->entries[i].block, new_blk);
+	if(split == 0){
+		free_blkno(new_blk);
+		return -1;
+	}
+
+	memmove(&root->entries[i + 2], &root->entries[i + 1], (root->count - i - 1) * sizeof(struct dx_entry));
+	root->entries[i + 1].hash = split;
+	root->entries[i + 1].block = new_blk;
+	root->count++;
+	dir_inode->blocks++;
+	return 0;
+}
+
+/*
+ * Turn a full single-block directory into an indexed one
+ */
+static int dx_create(struct inode *dir_inode) {
+	int root_blk = get_avail_blkno_near(inode_goal(dir_inode->ino));
+	if(root_blk < 0){
+		return -1;
+	}
+	struct dx_root *root = bio_get(root_blk);
+	memset(root, 0, BLOCK_SIZE);
+	root->magic = DX_MAGIC;
+	root->count = 1;
+	root->entries[0].hash = 0;
+	root->entries[0].block = extent_lookup(dir_inode, 0, NULL);
+	dir_inode->dir_index = root_blk;
+	memset(&dir_inode->ext_hdr, 0, sizeof(dir_inode->ext_hdr));
+	dir_inode->blocks++;
+
+	int ret = dx_split_leaf(dir_inode, root, 0);
+	bio_put(root_blk, 1);
+	return ret;
+}
+
+/*
+ * Add fname through the index, splitting its leaf if needed. Returns like
+ * dirblk_add(), with 1 also meaning the leaf could not be split.
+ */
+static int dx_add(struct inode *dir_inode, uint32_t f_ino, const char *fname, size_t name_len, uint8_t type) {
+	int root_blk = dir_inode->dir_index;
+	struct dx_root *root = bio_get(root_blk);
+	uint32_t hash = dx_hash(fname, name_len);
+
+	int i = dx_search(root, hash);
+	int ret = dirblk_add(root->entries[i].block, f_ino, fname, name_len, type);
+	if(ret == 1){
+		// Leaf is full: split it and retry in whichever half now covers hash
+		if(dx_split_leaf(dir_inode, root, i) != 0){
+			bio_put(root_blk, 0);
+			return 1;
+		}
+		i = dx_search(root, hash);
+		ret = dirblk_add(root->entries[i].block, f_ino, fname, name_len, type);
+		bio_put(root_blk, 1);
+		return ret;
+	}
+	bio_put(root_blk, 0);
+	return ret;
+}
+
+/*
+ * Collect the data blocks holding dir_inode's entries, in readdir order.
+ * blocks must have room for DX_LIMIT entries. Returns the number of blocks.
+ */
+int dir_blocks(struct inode *dir_inode, int *blocks) {
+	int count = 0;
+	if(dir_inode->dir_index != 0){
+		struct dx_root *root = bio_get(dir_inode->dir_index);
+		for(count = 0; count < root->count; count++){
+			blocks[count] = root->entries[count].block;
+		}
+		bio_put(dir_inode->dir_index, 0);
+		return count;
+	}
+	blocks[0] = extent_lookup(dir_inode, 0, NULL);
+	return blocks[0] != 0 ? 1 : 0;
+}
+
+/* 
+ * directory operations
+ *
+ * Lookups hold the directory's read lock and dir_add()/dir_remove() its
+ * write lock, so the dentry cache is always updated under the same lock
+ * that guarded the directory blocks the answer came from.
+ */
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+	// Step 1: Call iget() to get the inode using ino (inode number of current directory)
+	struct inode *curr_dir_inode = iget(ino);
+	irdlock(curr_dir_inode);
+
+	// Step 2: An indexed directory only needs the one leaf covering fname's hash
+	int ret = -1;
+	if(curr_dir_inode->dir_index != 0){
+		ret = dirblk_find(dx_leaf(curr_dir_inode, fname, name_len), fname, name_len, dirent);
+	}
+	else {
+		// Step 3: Otherwise read the directory's only data block and check each directory entry.
+		int blk = extent_lookup(curr_dir_inode, 0, NULL);
+		if(blk != 0){
+			ret = dirblk_find(blk, fname, name_len, dirent);
+		}
+	}
+
+	// Step 4: Remember the answer, found or not, while no writer can change it
+	dcache_insert(ino, fname, name_len, ret == 0 ? dirent->ino : DCACHE_NEGATIVE);
+	iunlock(curr_dir_inode);
+	iput(curr_dir_inode);
+	return ret;
+}
+
+/*
+ * Add (fname, f_ino) to the directory. Returns 0, -EEXIST if the name is
+ * taken, -ENAMETOOLONG or -ENOSPC.
+ */
+int dir_add(struct inode *dir_inode, uint32_t f_ino, const char *fname, size_t name_len, uint8_t type) {
+	int ret = -1;
+	if(name_len > NAME_LEN_MAX){
+		return -ENAMETOOLONG;
+	}
+	if(name_len == 0){
+		return -ENOENT;
+	}
+
+	iwrlock(dir_inode);
+	if(dir_inode->dir_index != 0){
+		// Step 1: Indexed directory, the hash picks the leaf to check and insert into
+		ret = dx_add(dir_inode, f_ino, fname, name_len, type);
+	}
+	else {
+		// Step 2: Single-block directory, check and insert in one pass and
+		// switch to an index once the block is full
+		int blk = extent_lookup(dir_inode, 0, NULL);
+		if(blk == 0){
+			blk = get_avail_blkno_near(inode_goal(dir_inode->ino));
+			if(blk < 0){
+				iunlock(dir_inode);
+				return -ENOSPC;
+			}
+			extent_insert(dir_inode, 0, blk, 1);
+			void *empty_block = malloc(BLOCK_SIZE);
+			dirblk_init(empty_block);
+			bio_write(blk, empty_block);
+			dir_inode->blocks++;
+			free(empty_block);
+		}
+		ret = dirblk_add(blk, f_ino, fname, name_len, type);
+		if(ret == 1 && dx_create(dir_inode) == 0){
+			ret = dx_add(dir_inode, f_ino, fname, name_len, type);
+		}
+	}
+
+	if(ret != 0){
+		// Persist any block or index the attempt allocated
+		iunlock(dir_inode);
+		imark_dirty(dir_inode);
+		return ret == -1 ? -EEXIST : -ENOSPC;
+	}
+
+	// Step 3: Update directory inode
+	dir_inode->size += DIRENT_LEN(name_len);
+	dir_inode->mtime = time(NULL);
+	dcache_insert(dir_inode->ino, fname, name_len, f_ino);
+	iunlock(dir_inode);
+	imark_dirty(dir_inode);
+	return 0;
+}
+
+int dir_remove(struct inode *dir_inode, const char *fname, size_t name_len) {
+
+	// Step 1: Find the directory block that should hold fname
+	int ret = -1;
+	iwrlock(dir_inode);
+	if(dir_inode->dir_index != 0){
+		ret = dirblk_remove(dx_leaf(dir_inode, fname, name_len), fname, name_len);
+	}
+	else {
+		// Step 2: Otherwise it can only be in the directory's single block
+		int blk = extent_lookup(dir_inode, 0, NULL);
+		if(blk != 0){
+			ret = dirblk_remove(blk, fname, name_len);
+		}
+	}
+	if(ret != 0){
+		iunlock(dir_inode);
+		return -ENOENT;
+	}
+
+	// Step 3: The entry is gone from its block, update the directory inode
+	dir_inode->size -= DIRENT_LEN(name_len);
+	dir_inode->mtime = time(NULL);
+
+	// Step 4: The name no longer resolves in this directory
+	dcache_insert(dir_inode->ino, fname, name_len, DCACHE_NEGATIVE);
+	iunlock(dir_inode);
+	imark_dirty(dir_inode);
+	return 0;
+}
+
+/* 
+ * namei operation
+ */
+
+/*
+ * Look one name up in directory ino: the dentry cache first, and dir_find()
+ * on a miss, which caches its result (found or not). Returns the inode
+ * number or -1.
+ */
+int dir_lookup(uint32_t ino, const char *fname, size_t name_len) {
+	int next_ino;
+	if(dcache_lookup(ino, fname, name_len, &next_ino)){
+		return next_ino == DCACHE_NEGATIVE ? -1 : next_ino;
+	}
+	struct dirent *dirent = malloc(DIRENT_MAX);
+	next_ino = -1;
+	if(dir_find(ino, fname, name_len, dirent) == 0){
+		next_ino = dirent->ino;
+	}
+	free(dirent);
+	return next_ino;
+}
+
+int get_ino_by_path(const char *path, uint32_t ino) {
+	
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	char *path_copy = strdup(path);
+	char *save = NULL;
+	char *path_arr = strtok_r(path_copy, "/", &save);
+	int cur_ino = ino;
+	
+	while(path_arr != NULL && cur_ino >= 0){
+		cur_ino = dir_lookup(cur_ino, path_arr, strlen(path_arr));
+		path_arr = strtok_r(NULL, "/", &save);
+	}
+
+	free(path_copy);
+	return cur_ino;
+}
+
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
+	int found = get_ino_by_path(path, ino);
+	if(found < 0){
+		return -1;
+	}
+	readi(found, inode);
+	return 0;
+}
+
+/*
+ * readahead
+ *
+ * Every open file remembers where its last read ended. A read that picks up
+ * there (the first read of a file starts at 0) is sequential, and the
+ * blocks after it are prefetched into the block cache in the background.
+ * The window starts at RA_INIT_BLOCKS, or twice the read if that is more,
+ * and doubles up to RA_MAX_BLOCKS every time the reader reaches the window
+ * issued before, so the next window is in flight while one is consumed.
+ * Any other read ends the stream.
+ */
+struct readahead {
+	pthread_mutex_t lock;
+	uint32_t next;		/* block after the last one read */
+	uint32_t start;		/* first block of the current window */
+	uint32_t size;		/* window length in blocks, 0 when not streaming */
+};
+
+/*
+ * Note a read of blocks first..last and prefetch what should come next.
+ * Called with the file's lock held.
+ */
+static void readahead(struct inode *file_inode, struct readahead *ra, uint32_t first, uint32_t last) {
+	uint32_t start = 0, len = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	if(first == ra->next || (first < ra->next && last >= ra->next)){
+		if(ra->size == 0){
+			// Step 1: A stream begins, the first window follows the read
+			ra->size = 2 * (last - first + 1);
+			if(ra->size < RA_INIT_BLOCKS){
+				ra->size = RA_INIT_BLOCKS;
+			}
+			if(ra->size > RA_MAX_BLOCKS){
+				ra->size = RA_MAX_BLOCKS;
+			}
+			ra->start = last + 1;
+			start = ra->start;
+			len = ra->size;
+		}
+		else if(last >= ra->start){
+			// Step 2: The reader reached the last window, issue a bigger one after it
+			start = ra->start + ra->size;
+			if(start <= last){
+				start = last + 1;
+			}
+			ra->size = ra->size * 2 > RA_MAX_BLOCKS ? RA_MAX_BLOCKS : ra->size * 2;
+			ra->start = start;
+			len = ra->size;
+		}
+	}
+	else {
+		ra->size = 0;
+	}
+	ra->next = last + 1;
+	pthread_mutex_unlock(&ra->lock);
+
+	// Step 3: Prefetch the mapped part of the window that lies inside the file
+	uint32_t eof = (file_inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if(len == 0 || start >= eof){
+		return;
+	}
+	if(start + len > eof){
+		len = eof - start;
+	}
+	for(uint32_t block = start; block < start + len; ){
+		uint32_t run;
+		uint32_t pblk = extent_lookup(file_inode, block, &run);
+		if(run > start + len - block){
+			run = start + len - block;
+		}
+		if(pblk != 0){
+			bio_prefetch(pblk, run);
+		}
+		block += run;
+	}
+}
+
+/*
+ * open file handles
+ *
+ * open() and create() resolve the path once and keep the inode pinned in
+ * the inode cache for as long as the file is open; fi->fh points at the
+ * open_file holding it and the file's readahead state. release() drops the
+ * pin. Calls that come without a handle (fh == 0) fall back to walking the
+ * path and get no readahead.
+ */
+struct open_file {
+	struct inode *inode;
+	struct readahead ra;
+};
+
+static uint64_t file_open(struct inode *inode) {
+	struct open_file *of = calloc(1, sizeof(struct open_file));
+	of->inode = inode;
+	pthread_mutex_init(&of->ra.lock, NULL);
+	return (uintptr_t) of;
+}
+
+static void file_close(struct fuse_file_info *fi) {
+	struct open_file *of = (struct open_file *) (uintptr_t) fi->fh;
+	if(of != NULL){
+		iput(of->inode);
+		pthread_mutex_destroy(&of->ra.lock);
+		free(of);
+		fi->fh = 0;
+	}
+}
+
+static inline struct open_file *file_handle(struct fuse_file_info *fi) {
+	return fi != NULL ? (struct open_file *) (uintptr_t) fi->fh : NULL;
+}
+
+/*
+ * Place the blocks of an open file that await allocation. Returns 0, or
+ * -ENOSPC if some of them could not be mapped.
+ */
+static int file_flush(struct fuse_file_info *fi) {
+	struct open_file *of = file_handle(fi);
+	if(of == NULL){
+		return 0;
+	}
+	if(journal_start() < 0){
+		return -EIO;
+	}
+	iwrlock(of->inode);
+	int pending = ientry(of->inode)->npending;
+	int ret = delalloc_flush(of->inode);
+	iunlock(of->inode);
+	if(pending > 0){
+		imark_dirty(of->inode);
+	}
+	if(journal_stop() < 0){
+		return -EIO;
+	}
+	return ret != 0 ? -ENOSPC : 0;
+}
+
+static inline struct readahead *file_ra(struct fuse_file_info *fi) {
+	struct open_file *of = file_handle(fi);
+	return of != NULL ? &of->ra : NULL;
+}
+
+static struct inode *file_get(const char *path, struct fuse_file_info *fi) {
+	struct open_file *of = file_handle(fi);
+	if(of != NULL){
+		return of->inode;
+	}
+	int ino = get_ino_by_path(path, 0);
+	if(ino < 0){
+		return NULL;
+	}
+	return iget(ino);
+}
+
+static void file_put(struct inode *inode, struct fuse_file_info *fi) {
+	if(fi == NULL || fi->fh == 0){
+		iput(inode);
+	}
+}
+
+/*
+ * core operations
+ *
+ * Shared by the path-based frontend (rufs_ope) and the inode-number one
+ * (rufs_ll_ope); each frontend only resolves its handles to pinned inodes.
+ */
+
+/*
+ * Create a file or directory called name in directory parent_ino. The new
+ * inode is set up (with "." and ".." for a directory) before it is linked
+ * into the parent, so no lookup can see it half built. Returns 0 with the
+ * new inode pinned in *out, or -errno.
+ */
+static int node_create(uint32_t parent_ino, const char *name, uint8_t type, struct inode **out) {
+	struct inode *parent = iget(parent_ino);
+	int isdir = S_ISDIR(parent->mode);
+	iput(parent);
+	if(!isdir){
+		return -ENOTDIR;
+	}
+
+	// Step 1: Call get_avail_ino_near() to get an available inode number
+	// near the parent. The whole creation is one journal transaction
+	if(journal_start() < 0){
+		return -EIO;
+	}
+	int ino_available = get_avail_ino_near(parent_ino, type == FT_DIR);
+	if(ino_available < 0){
+		journal_stop();
+		return -ENOSPC;
+	}
+
+	// Step 2: Set up the new inode while no other thread can reach it yet
+	struct inode *node = iget(ino_available);
+	iwrlock(node);
+	node->valid = VALID;
+	node->flags = type == FT_DIR ? 0 : INODE_INLINE;
+	node->size = 0;
+	memset(node->inline_data, 0, sizeof(node->inline_data));
+	node->dir_index = 0;
+	node->blocks = 0;
+	node->mode = type == FT_DIR ? S_IFDIR | 0755 : S_IFREG | 0666;
+	node->link = type == FT_DIR ? 2 : 1;
+	node->uid = getuid();
+	node->gid = getgid();
+	node->atime = node->mtime = node->ctime = time(NULL);
+	iunlock(node);
+	imark_dirty(node);
+
+	int ret = 0;
+	if(type == FT_DIR){
+		ret = dir_add(node, ino_available, ".", strlen("."), FT_DIR); // adding in the . to the new dir
+		if(ret == 0){
+			ret = dir_add(node, parent_ino, "..", strlen(".."), FT_DIR); //adding in the .. to
+		}
+	}
+
+	// Step 3: Publish it by calling dir_add() on the parent directory last
+	if(ret == 0){
+		struct inode *parent_inode = iget(parent_ino);
+		ret = dir_add(parent_inode, ino_available, name, strlen(name), type);
+		iput(parent_inode);
+	}
+
+	// Step 4: On failure give back the new node's block and inode
+	if(ret != 0){
+		iwrlock(node);
+		int blk = extent_lookup(node, 0, NULL);
+		if(blk != 0){
+			free_blkno(blk);
+		}
+		node->valid = 0;
+		iunlock(node);
+		imark_dirty(node);
+		free_ino(ino_available);
+		iput(node);
+		journal_stop();
+		return ret;
+	}
+	if(journal_stop() < 0){
+		iput(node);
+		return -EIO;
+	}
+	*out = node;
+	return 0;
+}
+
+/*
+ * Pass the entries of a directory to filler, starting at offset. An entry's
+ * offset is its byte position in the directory's block list, and each one
+ * is passed the offset of the entry after it, so a listing can be resumed.
+ * Stops early when filler returns nonzero.
+ */
+static void dir_iterate(struct inode *dir_inode, off_t offset, fuse_fill_dir_t filler, void *buffer) {
+	char *directories;
+	char name[NAME_LEN_MAX + 1];
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	int *blocks = malloc(DX_LIMIT * sizeof(int));
+
+	// The directory stays read-locked so no block is split or freed underneath
+	irdlock(dir_inode);
+	int nblocks = dir_blocks(dir_inode, blocks);
+	int full = 0;
+	for(int i = offset / BLOCK_SIZE; i < nblocks && !full; i++){
+		directories = bio_get(blocks[i]);
+		struct dirent *d;
+		for(int off = 0; off < BLOCK_SIZE && (d = dirblk_rec(directories, off))->rec_len != 0; off += d->rec_len){
+			off_t pos = (off_t) i * BLOCK_SIZE + off;
+			if(d->type != FT_FREE && pos >= offset){
+				//copy it
+				memcpy(name, d->name, d->name_len);
+				name[d->name_len] = '\0';
+				st.st_ino = d->ino;
+				st.st_mode = d->type == FT_DIR ? S_IFDIR : S_IFREG;
+				if(filler(buffer, name, &st, pos + d->rec_len) != 0){
+					full = 1;
+					break;
+				}
+			}
+		}
+		bio_put(blocks[i], 0);
+	}
+	iunlock(dir_inode);
+	free(blocks);
+}
+
+static int file_read(struct inode *file_inode, char *buffer, size_t size, off_t offset, struct readahead *ra) {
+
+	// Step 1: Readers of one file share its lock and only exclude writers
+	irdlock(file_inode);
+
+	// Step 2: Clamp the request to the end of the file
+	if(offset >= file_inode->size) {
+		iunlock(file_inode);
+		return 0;
+	}
+	if(offset + size > file_inode->size) {
+		size = file_inode->size - offset;
+	}
+
+	// Step 2b: An inline file is read straight out of the cached inode
+	if(file_inode->flags & INODE_INLINE) {
+		memcpy(buffer, file_inode->inline_data + offset, size);
+		__atomic_store_n(&file_inode->atime, time(NULL), __ATOMIC_RELAXED);
+		iunlock(file_inode);
+		imark_dirty(file_inode);
+		return size;
+	}
+
+	// Step 3: Resolve each extent once and gather the blocks to read. Fully
+	// covered blocks are read straight into the FUSE buffer, a partial first
+	// or last block goes through a bounce buffer and holes read back as zeros,
+	// unless they hold data still waiting for allocation
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t last = (offset + size - 1) / BLOCK_SIZE;
+	if(ra != NULL) {
+		// A stream gets the blocks after this read prefetched meanwhile
+		readahead(file_inode, ra, first, last);
+	}
+	int* blocks = malloc((last - first + 1) * sizeof(int));
+	void** bufs = malloc((last - first + 1) * sizeof(void*));
+	char* bounce = malloc(2 * BLOCK_SIZE);
+	int partialPos[2], partialOffset[2], partialLen[2];
+	int count = 0, partials = 0;
+	size_t bytesRead = 0;
+	uint32_t block = first;
+	while(block <= last) {
+		uint32_t run;
+		uint32_t pblk = extent_lookup(file_inode, block, &run);
+		for(uint32_t i = 0; i < run && block <= last; i++, block++) {
+			int blockOffset = (offset + bytesRead) % BLOCK_SIZE;
+			int bytesToRead = (size - bytesRead >= BLOCK_SIZE - blockOffset) ? BLOCK_SIZE - blockOffset : size - bytesRead;
+			char* pending = pblk == 0 ? delalloc_find(file_inode, block) : NULL;
+			if(pending != NULL) {
+				memcpy(buffer + bytesRead, pending + blockOffset, bytesToRead);
+			}
+			else if(pblk == 0) {
+				memset(buffer + bytesRead, 0, bytesToRead);
+			}
+			else if(bytesToRead == BLOCK_SIZE) {
+				blocks[count] = pblk + i;
+				bufs[count++] = buffer + bytesRead;
+			}
+			else {
+				partialPos[partials] = bytesRead;
+				partialOffset[partials] = blockOffset;
+				partialLen[partials] = bytesToRead;
+				blocks[count] = pblk + i;
+				bufs[count++] = bounce + partials++ * BLOCK_SIZE;
+			}
+			bytesRead += bytesToRead;
+		}
+	}
+
+	// Step 4: Physically contiguous blocks are merged into single reads
+	bio_readv(blocks, bufs, count);
+	for(int i = 0; i < partials; i++) {
+		memcpy(buffer + partialPos[i], bounce + i * BLOCK_SIZE + partialOffset[i], partialLen[i]);
+	}
+	free(bounce);
+	free(bufs);
+	free(blocks);
+
+	// Concurrent readers may all stamp atime, any of their values will do
+	__atomic_store_n(&file_inode->atime, time(NULL), __ATOMIC_RELAXED);
+	iunlock(file_inode);
+	imark_dirty(file_inode);
+	return bytesRead;
+}
+
+/*
+ * Describe size bytes at offset as a fuse_bufvec instead of copying them.
+ * Runs of whole blocks point at the disk file, so libfuse can splice them
+ * to /dev/fuse; partial blocks and holes are copied into small buffers.
+ * Every mem buffer is malloc'd on its own, the way libfuse frees them.
+ * Returns 0, or -EIO if a block could not be read, with nothing in *bufp.
+ */
+static int file_read_buf(struct inode *file_inode, struct fuse_bufvec **bufp, size_t size, off_t offset, struct readahead *ra) {
+
+	// Step 1: Clamp the request to the end of the file
+	irdlock(file_inode);
+	if(offset >= file_inode->size) {
+		size = 0;
+	}
+	else if(offset + size > file_inode->size) {
+		size = file_inode->size - offset;
+	}
+
+	// Step 2: One entry per extent run, plus one for each partial end block.
+	// An inline file is copied out of the cached inode as a single entry
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t last = size > 0 ? (offset + size - 1) / BLOCK_SIZE : first;
+	if(ra != NULL && size > 0 && !(file_inode->flags & INODE_INLINE)) {
+		// A stream gets the blocks after this read prefetched meanwhile
+		readahead(file_inode, ra, first, last);
+	}
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + (last - first + 2) * sizeof(struct fuse_buf));
+	bufv->count = 0;
+	bufv->idx = 0;
+	bufv->off = 0;
+	size_t bytesRead = 0;
+	int ret = 0;
+	if((file_inode->flags & INODE_INLINE) && size > 0) {
+		struct fuse_buf *fb = &bufv->buf[bufv->count++];
+		memset(fb, 0, sizeof(*fb));
+		fb->mem = malloc(size);
+		fb->size = size;
+		memcpy(fb->mem, file_inode->inline_data + offset, size);
+		bytesRead = size;
+	}
+	while(bytesRead < size) {
+		off_t pos = offset + bytesRead;
+		uint32_t block = pos / BLOCK_SIZE;
+		int blockOffset = pos % BLOCK_SIZE;
+		uint32_t run;
+		uint32_t pblk = extent_lookup(file_inode, block, &run);
+		struct fuse_buf *fb = &bufv->buf[bufv->count++];
+		memset(fb, 0, sizeof(*fb));
+
+		// A hole only reads as zeros up to the next block awaiting allocation
+		char* pending = NULL;
+		if(pblk == 0) {
+			struct icache_entry *e = ientry(file_inode);
+			int i = delalloc_search(e, block);
+			if(i < e->npending && e->pending[i].lblk == block) {
+				pending = e->pending[i].data;
+				run = 1;
+			}
+			else if(i < e->npending && e->pending[i].lblk - block < run) {
+				run = e->pending[i].lblk - block;
+			}
+		}
+
+		// Whole blocks of a mapped run come straight from the disk file
+		size_t whole = (size - bytesRead) / BLOCK_SIZE;
+		if(whole > run) {
+			whole = run;
+		}
+		if(pblk != 0 && blockOffset == 0 && whole > 0) {
+			fb->size = whole * BLOCK_SIZE;
+			fb->fd = bio_export(pblk, whole);
+			if(fb->fd >= 0) {
+				fb->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+				fb->pos = (off_t) pblk * BLOCK_SIZE;
+			}
+			else {
+				// A block held for the journal is only current in the cache
+				fb->mem = malloc(fb->size);
+				for(size_t k = 0; k < whole; k++) {
+					if(bio_read(pblk + k, (char*) fb->mem + k * BLOCK_SIZE) < 0) {
+						ret = -EIO;
+					}
+				}
+			}
+			bytesRead += fb->size;
+			continue;
+		}
+
+		// A hole is all zeros and a partial block goes through memory
+		size_t len = pblk == 0 ? (size_t) run * BLOCK_SIZE - blockOffset : (size_t) BLOCK_SIZE - blockOffset;
+		if(len > size - bytesRead) {
+			len = size - bytesRead;
+		}
+		fb->mem = calloc(1, pblk == 0 ? len : BLOCK_SIZE);
+		fb->size = len;
+		if(pending != NULL) {
+			memcpy(fb->mem, pending + blockOffset, len);
+		}
+		else if(pblk != 0) {
+			if(bio_read(pblk, fb->mem) < 0) {
+				ret = -EIO;
+			}
+			memmove(fb->mem, (char*) fb->mem + blockOffset, len);
+		}
+		bytesRead += len;
+	}
+
+	// Concurrent readers may all stamp atime, any of their values will do
+	__atomic_store_n(&file_inode->atime, time(NULL), __ATOMIC_RELAXED);
+	iunlock(file_inode);
+	imark_dirty(file_inode);
+	if(ret < 0) {
+		for(size_t i = 0; i < bufv->count; i++) {
+			free(bufv->buf[i].mem);
+		}
+		free(bufv);
+		return ret;
+	}
+	*bufp = bufv;
+	return 0;
+}
+
+/*
+ * Physical blocks behind count logical blocks of a file from first. Each
+ * hole gets a run of new blocks, as long as the free space allows, right
+ * after *prev so the extent keeps growing. Returns how many blocks were
+ * mapped, fewer than count if the disk filled up.
+ */
+static uint32_t file_blocks(struct inode *file_inode, uint32_t first, uint32_t count, int *blocks, uint32_t *prev) {
+	uint32_t done = 0;
+	while(done < count) {
+		uint32_t run;
+		uint32_t pblk = extent_lookup(file_inode, first + done, &run);
+		if(run > count - done) {
+			run = count - done;
+		}
+		if(pblk == 0) {
+			int got;
+			int newBlock = get_avail_blkno_run(*prev != 0 ? *prev + 1 : inode_goal(file_inode->ino), run, &got);
+			if(newBlock < 0) {
+				break;
+			}
+			if(extent_insert(file_inode, first + done, newBlock, got) != 0) {
+				free_blkno_run(newBlock, got);
+				break;
+			}
+			file_inode->blocks += got;
+			pblk = newBlock;
+			run = got;
+		}
+		for(uint32_t k = 0; k < run; k++) {
+			blocks[done + k] = pblk + k;
+		}
+		done += run;
+		*prev = pblk + run - 1;
+	}
+	return done;
+}
+
+/*
+ * Move an inline file's contents out of the inode. They become its first
+ * block, which waits for delayed allocation like any other new block.
+ * Called with the lock held for writing. Returns 0, or -1 if no block is
+ * left.
+ */
+static int inline_expand(struct inode *file_inode) {
+	char data[sizeof(file_inode->inline_data)];
+	memcpy(data, file_inode->inline_data, sizeof(data));
+	file_inode->flags &= ~INODE_INLINE;
+	memset(file_inode->inline_data, 0, sizeof(data));
+	if(file_inode->size == 0) {
+		return 0;
+	}
+	char* pending = delalloc_block(file_inode, 0);
+	if(pending == NULL) {
+		memcpy(file_inode->inline_data, data, sizeof(data));
+		file_inode->flags |= INODE_INLINE;
+		return -1;
+	}
+	memcpy(pending, data, file_inode->size);
+	return 0;
+}
+
+/*
+ * Write with the file's lock held for writing. Returns the bytes written,
+ * which fall short only when the disk fills up.
+ */
+static size_t file_write_locked(struct inode *file_inode, const char *buffer, size_t size, off_t offset) {
+
+	// Step 0: An inline file takes the write into the inode while it still
+	// fits there, and moves out to blocks for good once it does not
+	if(file_inode->flags & INODE_INLINE) {
+		if(offset + size <= INODE_IBLOCK(superblock->inode_size)) {
+			if(offset > file_inode->size) {
+				memset(file_inode->inline_data + file_inode->size, 0, offset - file_inode->size);
+			}
+			memcpy(file_inode->inline_data + offset, buffer, size);
+			if(offset + size > file_inode->size) {
+				file_inode->size = offset + size;
+			}
+			file_inode->mtime = time(NULL);
+			return size;
+		}
+		if(inline_expand(file_inode) != 0) {
+			return 0;
+		}
+	}
+
+	// Step 1: Map each block through the extent tree. Blocks in a hole are
+	// held back in memory, their allocation waits for delalloc_flush()
+	uint32_t first = offset / BLOCK_SIZE;
+	uint32_t last = size > 0 ? (offset + size - 1) / BLOCK_SIZE : first;
+	int* blocks = malloc((last - first + 1) * sizeof(int));
+	const void** bufs = malloc((last - first + 1) * sizeof(void*));
+	char* bounce = malloc(2 * BLOCK_SIZE);
+	int count = 0, partials = 0;
+	size_t bytesWritten = 0;
+	while(bytesWritten < size) {
+		off_t pos = offset + bytesWritten;
+		uint32_t block = pos / BLOCK_SIZE;
+		int blockOffset = pos % BLOCK_SIZE;
+		int bytesToWrite = (size - bytesWritten >= BLOCK_SIZE - blockOffset) ? BLOCK_SIZE - blockOffset : size - bytesWritten;
+
+		uint32_t pblk = extent_lookup(file_inode, block, NULL);
+		if(pblk == 0) {
+			char* pending = delalloc_block(file_inode, block);
+			if(pending == NULL) {
+				break;
+			}
+			memcpy(pending + blockOffset, buffer + bytesWritten, bytesToWrite);
+			bytesWritten += bytesToWrite;
+			continue;
+		}
+
+		// Step 2: Fully covered blocks are written straight from the FUSE
+		// buffer, partial ones are merged with their old contents first
+		blocks[count] = pblk;
+		if(bytesToWrite == BLOCK_SIZE) {
+			bufs[count++] = buffer + bytesWritten;
+		}
+		else {
+			char* tempBuf = bounce + partials++ * BLOCK_SIZE;
+			bio_read(pblk, tempBuf);
+			memcpy(tempBuf + blockOffset, buffer + bytesWritten, bytesToWrite);
+			bufs[count++] = tempBuf;
+		}
+		bytesWritten += bytesToWrite;
+	}
+
+	// Physically contiguous blocks are merged into single writes
+	bio_writev(blocks, bufs, count);
+	free(bounce);
+	free(bufs);
+	free(blocks);
+
+	// Step 3: Update the inode info, inode_sync() writes it to disk
+	if(offset + bytesWritten > file_inode->size) {
+		file_inode->size = offset + bytesWritten;
+	}
+	file_inode->mtime = time(NULL);
+	return bytesWritten;
+}
+
+static int file_write(struct inode *file_inode, const char *buffer, size_t size, off_t offset) {
+
+	// Block numbers are 32 bits, nothing past the last one can be mapped
+	if(offset > FILE_SIZE_MAX - (off_t) size) {
+		return -EFBIG;
+	}
+
+	// A writer holds the file's lock exclusively while it changes the mapping
+	if(journal_start() < 0) {
+		return -EIO;
+	}
+	iwrlock(file_inode);
+	size_t bytesWritten = file_write_locked(file_inode, buffer, size, offset);
+	iunlock(file_inode);
+	imark_dirty(file_inode);
+	if(journal_stop() < 0) {
+		return -EIO;
+	}
+
+	if(bytesWritten == 0 && size > 0) {
+		return -ENOSPC;
+	}
+	return bytesWritten;
+}
+
+/*
+ * Write the data described by bufv. When the request is still sitting in a
+ * pipe, whole blocks are copied from it straight into the disk file, which
+ * libfuse does with splice(), so they never pass through a user space
+ * buffer; only a partial first or last block is copied out and merged
+ * through file_write_locked(). A request already in memory goes through
+ * file_write_locked() as a whole, so its blocks get delayed allocation.
+ */
+static int file_write_buf(struct inode *file_inode, struct fuse_bufvec *bufv, off_t offset) {
+	size_t size = fuse_buf_size(bufv);
+	size_t bytesWritten = 0;
+	if(offset > FILE_SIZE_MAX - (off_t) size) {
+		return -EFBIG;
+	}
+
+	if(journal_start() < 0) {
+		return -EIO;
+	}
+	iwrlock(file_inode);
+
+	// Step 0: Data in memory is written like write() does, without a copy
+	// when it is a single buffer. So is anything written to an inline file,
+	// which has no blocks to splice into
+	int fromFd = bufv->buf[bufv->idx].flags & FUSE_BUF_IS_FD;
+	if(!fromFd || (file_inode->flags & INODE_INLINE)) {
+		if(bufv->count - bufv->idx == 1 && !fromFd) {
+			bytesWritten = file_write_locked(file_inode, (char*) bufv->buf[bufv->idx].mem + bufv->off, size, offset);
+		}
+		else {
+			struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+			mem.buf[0].mem = malloc(size);
+			size = fuse_buf_copy(&mem, bufv, 0);
+			bytesWritten = file_write_locked(file_inode, mem.buf[0].mem, size, offset);
+			free(mem.buf[0].mem);
+		}
+		iunlock(file_inode);
+		imark_dirty(file_inode);
+		journal_stop();
+		if(bytesWritten == 0 && size > 0) {
+			return -ENOSPC;
+		}
+		return bytesWritten;
+	}
+
+	// Step 1: Bytes up to the first block boundary
+	size_t head = offset % BLOCK_SIZE != 0 ? BLOCK_SIZE - offset % BLOCK_SIZE : 0;
+	if(head > size) {
+		head = size;
+	}
+	if(head > 0) {
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(head);
+		mem.buf[0].mem = malloc(head);
+		fuse_buf_copy(&mem, bufv, 0);
+		bytesWritten = file_write_locked(file_inode, mem.buf[0].mem, head, offset);
+		free(mem.buf[0].mem);
+	}
+
+	// Step 2: Map the whole blocks a stretch at a time, then move each
+	// physically contiguous run of the stretch in one copy. Blocks awaiting
+	// allocation, the head included, are placed first so the ones mapped here
+	// follow them on disk and never shadow them; if some cannot be, the rest
+	// goes through file_write_locked() as well. Only whole blocks that were
+	// copied count as written; if a copy comes up short, the blocks this
+	// stretch mapped past them are unmapped again, so that they never show
+	// what the disk held before
+	int placed = delalloc_flush(file_inode) == 0;
+	uint32_t first = (offset + head) / BLOCK_SIZE;
+	uint32_t nblocks = placed && bytesWritten == head ? (size - head) / BLOCK_SIZE : 0;
+	int* blocks = malloc(BIO_MAX_IOV * sizeof(int));
+	uint32_t prev = first > 0 ? extent_lookup(file_inode, first - 1, NULL) : 0;
+	uint32_t done = 0;
+	while(done < nblocks) {
+		uint32_t stretch;
+		int hole = extent_lookup(file_inode, first + done, &stretch) == 0;
+		if(stretch > nblocks - done) {
+			stretch = nblocks - done;
+		}
+		if(stretch > BIO_MAX_IOV) {
+			stretch = BIO_MAX_IOV;
+		}
+		uint32_t mapped = file_blocks(file_inode, first + done, stretch, blocks, &prev);
+		uint32_t moved = 0;
+		while(moved < mapped) {
+			uint32_t run = 1;
+			while(moved + run < mapped && blocks[moved + run] == blocks[moved] + run) {
+				run++;
+			}
+			size_t len = (size_t) run * BLOCK_SIZE;
+			ssize_t copied;
+			int fd = bio_import(blocks[moved], run);
+			if(fd >= 0) {
+				struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+				dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+				dst.buf[0].fd = fd;
+				dst.buf[0].pos = (off_t) blocks[moved] * BLOCK_SIZE;
+				copied = fuse_buf_copy(&dst, bufv, 0);
+			}
+			else {
+				// The backend cannot take direct writes, go through the block
+				// layer with the whole blocks that were copied
+				struct fuse_bufvec mem = FUSE_BUFVEC_INIT(len);
+				const void* bufs[BIO_MAX_IOV];
+				mem.buf[0].mem = malloc(len);
+				copied = fuse_buf_copy(&mem, bufv, 0);
+				int whole = copied > 0 ? copied / BLOCK_SIZE : 0;
+				for(int k = 0; k < whole; k++) {
+					bufs[k] = (char*) mem.buf[0].mem + (size_t) k * BLOCK_SIZE;
+				}
+				if(whole > 0 && bio_writev(&blocks[moved], bufs, whole) < 0) {
+					copied = 0;
+				}
+				free(mem.buf[0].mem);
+			}
+			moved += copied > 0 ? copied / BLOCK_SIZE : 0;
+			if(copied != (ssize_t) len) {
+				break;
+			}
+		}
+		bytesWritten += (size_t) moved * BLOCK_SIZE;
+		done += moved;
+		if(moved < stretch) {
+			if(hole && moved < mapped && extent_remove(file_inode, first + done, first + done + (mapped - moved)) != 0) {
+				for(uint32_t k = moved; k < mapped; k++) {
+					bio_zero(blocks[k], 1);
+				}
+			}
+			break;
+		}
+	}
+	free(blocks);
+
+	// Step 3: The partial last block, if everything before it made it
+	if(bytesWritten == head + (size_t) nblocks * BLOCK_SIZE && bytesWritten < size) {
+		size_t tail = size - bytesWritten;
+		struct fuse_bufvec mem = FUSE_BUFVEC_INIT(tail);
+		mem.buf[0].mem = malloc(tail);
+		fuse_buf_copy(&mem, bufv, 0);
+		bytesWritten += file_write_locked(file_inode, mem.buf[0].mem, tail, offset + bytesWritten);
+		free(mem.buf[0].mem);
+	}
+
+	// Step 4: Update the inode info, inode_sync() writes it to disk
+	if(offset + bytesWritten > file_inode->size) {
+		file_inode->size = offset + bytesWritten;
+	}
+	file_inode->mtime = time(NULL);
+	iunlock(file_inode);
+	imark_dirty(file_inode);
+	if(journal_stop() < 0) {
+		return -EIO;
+	}
+
+	if(bytesWritten == 0 && size > 0) {
+		return -ENOSPC;
+	}
+	return bytesWritten;
+}
+
+/*
+ * Zero len bytes at offset, all within one block of a file that is not
+ * inline. A hole stays a hole. Called with the lock held for writing.
+ */
+static void file_zero_locked(struct inode *file_inode, off_t offset, size_t len) {
+	uint32_t block = offset / BLOCK_SIZE;
+	int blockOffset = offset % BLOCK_SIZE;
+	uint32_t pblk = extent_lookup(file_inode, block, NULL);
+	if(pblk == 0) {
+		char* pending = delalloc_find(file_inode, block);
+		if(pending != NULL) {
+			memset(pending + blockOffset, 0, len);
+		}
+		return;
+	}
+	char* tempBuf = malloc(BLOCK_SIZE);
+	const void* buf = tempBuf;
+	int blk = pblk;
+	bio_read(blk, tempBuf);
+	memset(tempBuf + blockOffset, 0, len);
+	bio_writev(&blk, &buf, 1);
+	free(tempBuf);
+}
+
+/*
+ * Set the size of a file with the lock held for writing. Shrinking frees
+ * every block past the new end in one pass and zeroes the rest of the last
+ * block, so bytes beyond the end always read back as zeros; growing leaves
+ * a hole. Returns 0, or -ENOSPC if an inline file could not move out.
+ */
+static int file_truncate_locked(struct inode *file_inode, off_t size) {
+
+	// Step 0: An inline file stays inline as long as the new size fits
+	if(file_inode->flags & INODE_INLINE) {
+		if(size <= INODE_IBLOCK(superblock->inode_size)) {
+			if(size < file_inode->size) {
+				memset(file_inode->inline_data + size, 0, file_inode->size - size);
+			}
+			file_inode->size = size;
+			file_inode->mtime = file_inode->ctime = time(NULL);
+			return 0;
+		}
+		if(inline_expand(file_inode) != 0) {
+			return -ENOSPC;
+		}
+	}
+
+	// Step 1: Drop the pending and mapped blocks from the first one wholly
+	// past the new end on
+	if(size < file_inode->size) {
+		if(size % BLOCK_SIZE != 0) {
+			file_zero_locked(file_inode, size, BLOCK_SIZE - size % BLOCK_SIZE);
+		}
+		uint32_t first = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		delalloc_drop(file_inode, first, UINT32_MAX);
+		extent_remove(file_inode, first, UINT32_MAX);
+	}
+
+	file_inode->size = size;
+	file_inode->mtime = file_inode->ctime = time(NULL);
+	return 0;
+}
+
+/*
+ * Give the blocks of logical blocks first..last that are holes disk blocks
+ * of their own, in runs as long as the free space allows, right after the
+ * blocks before them. Blocks waiting for delayed allocation are placed
+ * first. The extent format has no unwritten extents, so new blocks are
+ * zeroed in the disk file by bio_zero(), which lets the host file system
+ * do it without writing them out, before they are mapped. Called with the
+ * lock held for writing. Returns 0, -ENOSPC when the disk fills up, or
+ * -EIO if the blocks could not be zeroed, keeping what was allocated.
+ */
+static int file_allocate_locked(struct inode *file_inode, uint32_t first, uint32_t last) {
+	if(delalloc_flush(file_inode) != 0) {
+		return -ENOSPC;
+	}
+
+	int ret = 0;
+	uint32_t prev = first > 0 ? extent_lookup(file_inode, first - 1, NULL) : 0;
+	uint64_t block = first;
+	while(block <= last) {
+		uint32_t run;
+		uint32_t pblk = extent_lookup(file_inode, block, &run);
+		if(run > last - block + 1) {
+			run = last - block + 1;
+		}
+		if(pblk == 0) {
+			int got;
+			int newBlock = get_avail_blkno_run(prev != 0 ? prev + 1 : inode_goal(file_inode->ino), run, &got);
+			if(newBlock < 0) {
+				ret = -ENOSPC;
+				break;
+			}
+			if(bio_zero(newBlock, got) != 0) {
+				free_blkno_run(newBlock, got);
+				ret = -EIO;
+				break;
+			}
+			if(extent_insert(file_inode, block, newBlock, got) != 0) {
+				free_blkno_run(newBlock, got);
+				ret = -ENOSPC;
+				break;
+			}
+			file_inode->blocks += got;
+			pblk = newBlock;
+			run = got;
+		}
+		block += run;
+		prev = pblk + run - 1;
+	}
+	return ret;
+}
+
+/*
+ * Free the whole blocks of [offset, offset + len), including any allocated
+ * past the end of the file, and zero the parts of blocks at either end
+ * that are inside the file, without changing the size. Called with the
+ * lock held for writing. Returns 0, or -ENOSPC if splitting an extent
+ * needed a tree block that was not there.
+ */
+static int file_punch_locked(struct inode *file_inode, off_t offset, off_t len) {
+	off_t end = offset + len;
+	off_t zeroEnd = end < (off_t) file_inode->size ? end : (off_t) file_inode->size;
+	if(file_inode->flags & INODE_INLINE) {
+		if(offset < zeroEnd) {
+			memset(file_inode->inline_data + offset, 0, zeroEnd - offset);
+		}
+		return 0;
+	}
+
+	// Step 1: Zero what is left of the first and last blocks, up to the end
+	// of the file
+	uint32_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint32_t last = end / BLOCK_SIZE;
+	if(first > last) {
+		if(offset < zeroEnd) {
+			file_zero_locked(file_inode, offset, zeroEnd - offset);
+		}
+		return 0;
+	}
+	off_t headEnd = (off_t) first * BLOCK_SIZE < zeroEnd ? (off_t) first * BLOCK_SIZE : zeroEnd;
+	if(offset % BLOCK_SIZE != 0 && offset < headEnd) {
+		file_zero_locked(file_inode, offset, headEnd - offset);
+	}
+	if(end % BLOCK_SIZE != 0 && (off_t) last * BLOCK_SIZE < zeroEnd) {
+		file_zero_locked(file_inode, (off_t) last * BLOCK_SIZE, zeroEnd - (off_t) last * BLOCK_SIZE);
+	}
 
-  	// Step 1: Get the inode's on-disk block number
-  	int block = superblock->i_start_blk + ((ino * sizeof(struct inode)) / BLOCK_SIZE);
-  	// Step 2: Get offset of the inode in the inode on-disk block
-  	int offset = ino % (BLOCK_SIZE / sizeof(struct inode));
-  	// Step 3: Read the block from disk and then copy into inode structure
-  	struct inode *reading_block = malloc(BLOCK_SIZE);
-	bio_read(block, (void*) reading_block);
-	memcpy(inode,&reading_block[offset],sizeof(struct inode));
+	// Step 2: Unmap the blocks in between, pending or on disk
+	delalloc_drop(file_inode, first, last);
+	if(first < last && extent_remove(file_inode, first, last) != 0) {
+		return -ENOSPC;
+	}
 	return 0;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
-
-	// Step 1: Get the block number where this inode resides on disk
-	int block = superblock->i_start_blk + ((ino * sizeof(struct inode)) / BLOCK_SIZE);
-	// Step 2: Get the offset in the block where this inode resides on disk
-  	int offset = ino % (BLOCK_SIZE / sizeof(struct inode));
-	// Step 3: Write inode to disk 
-	struct inode *writing_block = malloc(BLOCK_SIZE);
-	bio_read(block, (void*) writing_block);
-	writing_block[offset] = *inode;
-	bio_write(block, (void*) writing_block);
-	free(writing_block);
-	return 0;
+static int file_truncate(struct inode *file_inode, off_t size) {
+	if(S_ISDIR(file_inode->mode)) {
+		return -EISDIR;
+	}
+	if(size < 0) {
+		return -EINVAL;
+	}
+	if(size > FILE_SIZE_MAX) {
+		return -EFBIG;
+	}
+	if(journal_start() < 0) {
+		return -EIO;
+	}
+	iwrlock(file_inode);
+	int ret = file_truncate_locked(file_inode, size);
+	iunlock(file_inode);
+	imark_dirty(file_inode);
+	if(journal_stop() < 0) {
+		return -EIO;
+	}
+	return ret;
 }
 
-
-/* 
- * directory operations
+/*
+ * fallocate(): by default, and with FALLOC_FL_KEEP_SIZE, every block of
+ * [offset, offset + len) gets disk space up front, so later writes neither
+ * allocate nor fragment, and the file grows over the range unless
+ * KEEP_SIZE says otherwise. FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE
+ * turns the range into a hole instead.
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-
-	// Step 1: Call readi() to get the inode using ino (inode number of current directory)
-	struct inode *curr_dir_inode = malloc(sizeof(struct inode));
-	readi(ino,curr_dir_inode);
-
-	// Step 2: Get data block of current directory from inode
-	struct dirent *cur_dir_db = malloc(BLOCK_SIZE);
-
-	// Step 3: Read directory's data block and check each directory entry.
-	int ptr_index = 0;
-	int block_index = 0;
-	while(ptr_index < DIRECT_PTR_SIZE){
-		if(curr_dir_inode->direct_ptr[ptr_index] == 0){
-			free(curr_dir_inode);
-			free(cur_dir_db);
-			return -1;
-		}
-		
-		//reading in the block
-		bio_read(curr_dir_inode->direct_ptr[ptr_index],cur_dir_db);
+static int file_fallocate(struct inode *file_inode, int mode, off_t offset, off_t len) {
+	if(offset < 0 || len <= 0) {
+		return -EINVAL;
+	}
+	if((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0
+			|| ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))) {
+		return -EOPNOTSUPP;
+	}
+	if(S_ISDIR(file_inode->mode)) {
+		return -EISDIR;
+	}
+	if(offset > FILE_SIZE_MAX - len) {
+		return -EFBIG;
+	}
 
-		//itterate through the block
-		while(block_index < num_dir){
-			//If the name matches, then copy directory entry to dirent structure
-			if(cur_dir_db[block_index].valid == VALID && strcmp(fname,cur_dir_db[block_index].name) == 0){
-				time(&(curr_dir_inode->vstat.st_atime));
-				*dirent = cur_dir_db[block_index];
-				free(curr_dir_inode);
-				free(cur_dir_db);
-				return 0;
+	if(journal_start() < 0) {
+		return -EIO;
+	}
+	iwrlock(file_inode);
+	uint32_t blocks = file_inode->blocks;
+	uint64_t size = file_inode->size;
+	int ret = 0;
+	if(mode & FALLOC_FL_PUNCH_HOLE) {
+		ret = file_punch_locked(file_inode, offset, len);
+	}
+	else {
+		// Step 1: An inline file has its space already while the range fits
+		// in the inode
+		if((file_inode->flags & INODE_INLINE) && offset + len > INODE_IBLOCK(superblock->inode_size)) {
+			if(inline_expand(file_inode) != 0) {
+				ret = -ENOSPC;
 			}
-			block_index++;
 		}
-		
-		block_index = 0;
-		ptr_index++;
-	}
-	free(curr_dir_inode);
-	free(cur_dir_db);
-	return -1;
-}
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	struct dirent *cur_dir_db = malloc(BLOCK_SIZE);
-	// Step 2: Check if fname (directory name) is already used in other entries
-	int ptr_index = 0;
-	int block_index = 0;
-	while(ptr_index < DIRECT_PTR_SIZE){
-		if(dir_inode.direct_ptr[ptr_index] == 0){
-			break;
+		// Step 2: Fill the holes, then grow the file over what was allocated
+		if(ret == 0 && !(file_inode->flags & INODE_INLINE)) {
+			ret = file_allocate_locked(file_inode, offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE);
 		}
-		bio_read(dir_inode.direct_ptr[ptr_index], cur_dir_db);
-		while(block_index < num_dir){
-			if(cur_dir_db[block_index].valid == VALID && strcmp(fname, cur_dir_db[block_index].name) == 0){
-				free(cur_dir_db);
-				return -1;
-			}
-			block_index++;
+		if(ret == 0 && !(mode & FALLOC_FL_KEEP_SIZE) && offset + len > (off_t) file_inode->size) {
+			file_inode->size = offset + len;
 		}
-		block_index = 0;
-		ptr_index++;
-
 	}
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
-	ptr_index = 0;
-	block_index = 0;
-	while(ptr_index < DIRECT_PTR_SIZE){
-		// Allocate a new data block for this directory if it does not exist
-		if(dir_inode.direct_ptr[ptr_index] == 0){
-			//that means no block exists to allocate it
-			dir_inode.direct_ptr[ptr_index] = get_avail_blkno();
-			struct dirent *empty_block = malloc(BLOCK_SIZE);
-			bio_write(dir_inode.direct_ptr[ptr_index], empty_block);
-			dir_inode.vstat.st_blocks++;
-			free(empty_block);
-		}
 
-		//read the block and find an empty spot 
-		bio_read(dir_inode.direct_ptr[ptr_index], cur_dir_db);
-		while(block_index < num_dir){
-			//find an empty spot
-			if(cur_dir_db[block_index].valid != VALID){
-				//means empty
-				cur_dir_db[block_index].ino = f_ino;
-				strcpy(cur_dir_db[block_index].name, fname);
-				cur_dir_db[block_index].len = name_len;
-				cur_dir_db[block_index].valid = VALID;
-				// Update directory inode
-				dir_inode.size += sizeof(struct dirent);
-				dir_inode.vstat.st_size += sizeof(struct dirent);
-				time(&(dir_inode.vstat.st_mtime));
-				// Write directory entry
-				writei(dir_inode.ino, &dir_inode);
-				bio_write(dir_inode.direct_ptr[ptr_index], cur_dir_db);
-				free(cur_dir_db);
-				return 0;
-			}
-			block_index++;
-		}
-
-		block_index = 0;
-		ptr_index++;
-	}
-	free(cur_dir_db);
-	return -1;
+	// Step 3: The times change only with the blocks or size; space that
+	// was there already changes nothing
+	if((mode & FALLOC_FL_PUNCH_HOLE) || file_inode->blocks != blocks || file_inode->size != size) {
+		file_inode->mtime = file_inode->ctime = time(NULL);
+	}
+	iunlock(file_inode);
+	imark_dirty(file_inode);
+	if(journal_stop() < 0) {
+		return -EIO;
+	}
+	return ret;
 }
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
-
-	// Step 1: Read dir_inode's data block and checks each directory entry of dir_inode
-	
-	// Step 2: Check if fname exist
-
-	// Step 3: If exist, then remove it from dir_inode's data block and write to disk
-
-	return 0;
+/*
+ * Bring the inode table and bitmaps in the block cache up to date, so a
+ * journal commit sees every change made so far, placing data that has
+ * waited for allocation long enough first
+ */
+static void journal_prepare() {
+	delalloc_sync(0);
+	inode_sync();
+	bitmap_sync();
+	discard_close();
 }
 
-/* 
- * namei operation
+/*
+ * A journal commit is on disk (ok) or failed: punch out the blocks it freed
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-	char *path_arr = strtok((char *)path,"/");
-	struct dirent *cur_dir_db = malloc(BLOCK_SIZE);
-	cur_dir_db->ino = ino;
-	
-	while(path_arr != NULL){
-		if(dir_find(cur_dir_db->ino, path_arr, strlen(path_arr), cur_dir_db) == -1){
-			free(cur_dir_db);
-			return -1;
-		}
-		path_arr = strtok(NULL,"/");
-	}
-
-	readi(cur_dir_db->ino,inode);
-	free(cur_dir_db);
-	return 0;
+static void journal_committed(int ok) {
+	discard_done(ok);
 }
 
-/* 
- * Make file system
+/*
+ * Write back the metadata changed so far. With a journal this is a commit,
+ * waited for only if durable is set, and the blocks reach their home
+ * location at the next checkpoint. Without one (mmap backend) the inodes,
+ * bitmaps and block cache are written back directly.
  */
-int rufs_mkfs() {
-
-	// Call dev_init() to initialize (Create) Diskfile
-	dev_init(diskfile_path);
-	
-	// write superblock information
-	superblock = malloc(BLOCK_SIZE);
-	superblock->i_bitmap_blk = 1;
-	superblock->d_bitmap_blk = 2;
-	superblock->i_start_blk = 3;
-	superblock->d_start_blk = 3 + ((sizeof(struct inode) * MAX_INUM) / BLOCK_SIZE); //67
-	superblock->magic_num = MAGIC_NUM;
-	superblock->max_dnum = MAX_DNUM;
-	superblock->max_inum = MAX_INUM;
-	bio_write(0, superblock);
-	
-	// initialize inode bitmap
-	i_bmap = malloc(BLOCK_SIZE);
-	// initialize data block bitmap
-	d_bmap = malloc(BLOCK_SIZE);
-	
-	//setting the inodes
-	int index = 0;
-	while(index < superblock->d_start_blk){
-		set_bitmap(d_bmap, index);
-		index++;
+static int fs_commit(int durable) {
+	if(journal_active()){
+		return journal_commit(durable);
 	}
-	bio_write(superblock->d_bitmap_blk, d_bmap);
-	
-	// update inode for root directory
-	struct inode *root_dir_inode = malloc(BLOCK_SIZE);
-	bio_read(superblock->i_start_blk, root_dir_inode);
-	root_dir_inode->ino = get_avail_ino(); //inode 0
-	root_dir_inode->valid = 1; //is valid
-	root_dir_inode->type = 1; //dir
-	root_dir_inode->link = 0; //no links yet
-	memset(root_dir_inode->direct_ptr, 0, sizeof(int) * 16);
-	memset(root_dir_inode->indirect_ptr, 0, sizeof(int) * 8);
-	root_dir_inode->direct_ptr[0] = get_avail_blkno();//block 67
-	
-	//set stats
-	root_dir_inode->vstat.st_mode = S_IFDIR | 0755;
-	root_dir_inode->vstat.st_nlink = 2;
-	root_dir_inode->vstat.st_blocks = 1;
-	root_dir_inode->vstat.st_blksize = BLOCK_SIZE;
-	root_dir_inode->vstat.st_gid = getgid();
-	root_dir_inode->vstat.st_uid = getuid();
-	time(&(root_dir_inode->vstat.st_mtime));
-	time(&(root_dir_inode->vstat.st_ctime));
-
-	//Write root node
-	bio_write(superblock->i_start_blk, root_dir_inode);
-	free(root_dir_inode);
-	
-	//creating the parent and root dirent 
-	struct dirent *root_dir = malloc(BLOCK_SIZE);
-	root_dir[0].ino = 0;
-	root_dir[0].valid = 1;
-	strcpy(root_dir[0].name, ".");
-	root_dir[0].len = strlen(root_dir[0].name);
-	//parent
-	root_dir[1].ino = 0;
-	root_dir[1].valid = 1;
-	strcpy(root_dir[1].name, "..");
-	root_dir[1].len = strlen(root_dir[1].name);
-	bio_write(superblock->d_start_blk, root_dir); //67
-	free(root_dir);
-	return 0;
+	inode_sync();
+	bitmap_sync();
+	int ret = durable ? dev_sync() : dev_flush();
+	discard_close();
+	discard_done(ret == 0);
+	return ret;
 }
 
-
 /* 
  * FUSE file operations
  */
 static void *rufs_init(struct fuse_conn_info *conn) {
 
-	// Step 1a: If disk file is not found, call mkfs
+	// Step 0: Ask for large writes and for requests to be spliced through
+	// pipes, as far as the kernel supports them
+	conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_SPLICE_READ
+		| FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+	conn->max_write = RUFS_MAX_WRITE;
+	if(conn->max_readahead > RUFS_MAX_READAHEAD){
+		conn->max_readahead = RUFS_MAX_READAHEAD;
+	}
+
+	// Step 1a: If disk file is not found, make one with the default geometry
 	if(dev_open(diskfile_path) == -1){
-		rufs_mkfs();
-		return NULL;
+		struct rufs_geometry geo = { DISK_SIZE, BLOCK_SIZE_MIN, 0, JOURNAL_BLOCKS, 0, INODE_SIZE_DEFAULT };
+		if(rufs_format(diskfile_path, &geo) < 0 || dev_open(diskfile_path) == -1){
+			exit(EXIT_FAILURE);
+		}
 	}
 	
-	// Step 1b: If disk file is found, just initialize in-memory data structures
-	// and read superblock from disk
+	// Step 1b: Read superblock from disk. It fits in the smallest block size,
+	// so a disk made with another one is reopened with that
 	superblock = malloc(BLOCK_SIZE);
 
 	bio_read(0, superblock);
+	if(superblock->magic_num != MAGIC_NUM){
+		fprintf(stderr, "rufs: %s is not a RUFS disk of this format version\n", diskfile_path);
+		exit(EXIT_FAILURE);
+	}
+	if(superblock->block_size != (uint32_t) BLOCK_SIZE){
+		int size = superblock->block_size;
+		dev_close();
+		if(dev_set_block_size(size) < 0 || dev_open(diskfile_path) == -1){
+			fprintf(stderr, "rufs: %s has an unsupported block size %d\n", diskfile_path, size);
+			exit(EXIT_FAILURE);
+		}
+		superblock = realloc(superblock, BLOCK_SIZE);
+		bio_read(0, superblock);
+	}
+	uint32_t isize = superblock->inode_size;
+	if(isize < INODE_SIZE_MIN || isize > INODE_SIZE_MAX || (isize & (isize - 1)) != 0){
+		fprintf(stderr, "rufs: %s has an unsupported inode size %u\n", diskfile_path, isize);
+		exit(EXIT_FAILURE);
+	}
+
+	// Step 1c: Replay what the journal holds before any metadata is read
+	int replayed = journal_load(superblock->j_start_blk, superblock->j_blocks, journal_prepare, journal_committed);
+	if(replayed < 0){
+		fprintf(stderr, "rufs: %s has no usable journal\n", diskfile_path);
+		exit(EXIT_FAILURE);
+	}
+	if(replayed > 0){
+		fprintf(stderr, "rufs: replayed %d journal transactions\n", replayed);
+		// A transaction that grew the inode table also changed the superblock
+		bio_read(0, superblock);
+	}
+
+	// Step 1d: Load the bitmaps, as many blocks as the geometry needs, and
+	// count what each allocation group has free
+	d_bmap = bitmap_read(superblock->d_bitmap_blk, superblock->max_dnum);
+	i_bmap = bitmap_read(superblock->i_bitmap_blk, superblock->max_inum);
+	d_bmap_blocks = BITMAP_BLOCKS(superblock->max_dnum);
+	i_bmap_blocks = BITMAP_BLOCKS(superblock->max_inum);
+	d_bmap_dirty = calloc(d_bmap_blocks, 1);
+	i_bmap_dirty = calloc(i_bmap_blocks, 1);
+	groups_init();
 
-	d_bmap = malloc(BLOCK_SIZE);
-	i_bmap = malloc(BLOCK_SIZE);
-	bio_read(superblock->d_bitmap_blk, d_bmap);
-	bio_read(superblock->i_bitmap_blk, i_bmap);
+	// Step 1e: Like fstrim, punch every block that is free out of the disk
+	// file. The bitmaps on disk are committed, so all of them can go
+	if(discard_at_mount){
+		discard_range(superblock->d_start_blk, superblock->max_dnum - superblock->d_start_blk);
+	}
 	
 	return NULL;
 }
 
 static void rufs_destroy(void *userdata) {	
 
-	// Step 1: De-allocate in-memory data structures
+	// Step 1: Write back the inodes and bitmaps, commit and checkpoint the
+	// journal and de-allocate in-memory data structures
+	dcache_destroy();
+	icache_destroy();
+	bitmap_sync();
+	if(journal_active()){
+		// The last commit released the blocks it freed after the fact
+		journal_close();
+		bitmap_sync();
+	}
+	else {
+		// Without a journal the bitmaps are on their way to the disk file already
+		discard_close();
+		discard_done(1);
+	}
 	free(superblock);
 	free(d_bmap);
 	free(i_bmap);
-	// Step 2: Close diskfile
+	free(d_bmap_dirty);
+	free(i_bmap_dirty);
+	d_bmap_blocks = i_bmap_blocks = 0;
+	groups_destroy();
+	// Step 2: Close diskfile, writing back everything still in the block cache
 	dev_close();
 }
 
 static int rufs_getattr(const char *path, struct stat *stbuf) {
-	struct inode *inode_lookup = malloc(sizeof(struct inode));
-	// Step 1: call get_node_by_path() to get inode from path
-	if(get_node_by_path(path, 0, inode_lookup) != 0){
-		free(inode_lookup);
+	// Step 1: call get_ino_by_path() to get the inode number from path
+	int ino = get_ino_by_path(path, 0);
+	if(ino < 0){
 		return -ENOENT;
 	}
 	
-	// Step 2: fill attribute of file into stbuf from inode
-	*stbuf = inode_lookup->vstat;
-	free(inode_lookup);
+	// Step 2: fill attribute of file into stbuf from the cached inode
+	struct inode *inode_lookup = iget(ino);
+	irdlock(inode_lookup);
+	inode_stat(inode_lookup, stbuf);
+	iunlock(inode_lookup);
+	iput(inode_lookup);
 	return 0;
 }
 
 static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
 
-	struct inode *inode_lookup = malloc(sizeof(struct inode));
-	// Step 1: Call get_node_by_path() to get inode from path
-	if(get_node_by_path(path, 0, inode_lookup) == 0){
+	// Step 1: Call get_ino_by_path() to look the path up
+	if(get_ino_by_path(path, 0) >= 0){
 		//success
-		free(inode_lookup);
 		return 0;
 	}
 	// Step 2: If not find, return -1
-	free(inode_lookup);
     return -ENOENT;
 }
 
 static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
 
-	// Step 1: Call get_node_by_path() to get inode from path
-	struct inode *inode_lookup = malloc(sizeof(struct inode));
-	if(get_node_by_path(path, 0, inode_lookup) != 0){
-		free(inode_lookup);
+	// Step 1: Call get_ino_by_path() to get the directory's inode from path
+	int ino = get_ino_by_path(path, 0);
+	if(ino < 0){
 		return -ENOENT;
 	}
 
-	// Step 2: Read directory entries from its data blocks, and copy them to filler
-	struct dirent *directories = malloc(BLOCK_SIZE);
-	int ptr_index = 0;
-	int block_index = 0;
-	while(ptr_index < DIRECT_PTR_SIZE){
-		if(inode_lookup->direct_ptr[ptr_index] == 0){
-			//theres nothing there
-			break;
-		}
-		bio_read(inode_lookup->direct_ptr[ptr_index],directories);
-		while(block_index < num_dir){
-			if(directories[block_index].valid == VALID){
-				//copy it
-				filler(buffer,directories[block_index].name, NULL, 0);
-			}
-			block_index++;
-		}
-		
-		block_index = 0;
-		ptr_index++;
-
-	}
-	free(directories);
-	free(inode_lookup);
+	// Step 2: Hand the directory entries from offset on to filler
+	struct inode *inode_lookup = iget(ino);
+	dir_iterate(inode_lookup, offset, filler, buffer);
+	iput(inode_lookup);
 	return 0;
 }
 
 
 static int rufs_mkdir(const char *path, mode_t mode) {
 	// Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-	char *parent = malloc(strlen(path) + 1);
-    strcpy(parent, path);
-    dirname(parent);
-    char *dir_to_add = malloc(strlen(path) + 1);
-    strcpy(dir_to_add, path);
+	char *parent = strdup(path);
+	dirname(parent);
+	char *dir_copy = strdup(path);
+	char *dir_name = basename(dir_copy);
 
-    char *dir_copy = malloc(strlen(path) + 1);
-    strcpy(dir_copy, path);
-    char *dir_name = basename(dir_copy);
-
-    strcpy(dir_to_add, dir_name);
-	free(dir_copy);
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode *parent_inode = malloc(sizeof(struct inode));
-	if(get_node_by_path(parent, 0, parent_inode) != 0){
-		free(parent_inode);
-		free(dir_to_add);
-		free(parent);
-		return -ENOENT;
+	// Step 2: Call get_ino_by_path() to get inode of parent directory
+	int parent_ino = get_ino_by_path(parent, 0);
+	int ret = -ENOENT;
+	if(parent_ino >= 0){
+		// Step 3: Create the directory and link it into its parent
+		struct inode *just_added_dir;
+		ret = node_create(parent_ino, dir_name, FT_DIR, &just_added_dir);
+		if(ret == 0){
+			iput(just_added_dir);
+		}
 	}
-
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int ino_available = get_avail_ino();
-
-	// Step 4: Call dir_add() to add directory entry of target directory to parent directory
-	dir_add(*parent_inode, ino_available, dir_to_add, strlen(dir_to_add));
-
-	// Step 5: Update inode for target directory
-	struct inode *just_added_dir = malloc(sizeof(struct inode));
-	readi(ino_available,just_added_dir);
-	just_added_dir->ino = ino_available;
-	just_added_dir->valid = VALID;
-	just_added_dir->type = 1;
-	just_added_dir->vstat.st_mode = S_IFDIR | 0755;
-	memset(just_added_dir->direct_ptr, 0, sizeof(int) * DIRECT_PTR_SIZE);
-	writei(ino_available, just_added_dir);
-
-	dir_add(*just_added_dir, ino_available, ".", strlen(".")); // adding in the . to the new dir
-	readi(ino_available, just_added_dir);
-	dir_add(*just_added_dir, parent_inode->ino, "..", strlen("..")); //adding in the .. to
-	// Step 6: Call writei() to write inode to disk
-	//dir_add will do the last writei()
-	free(just_added_dir);
-	free(parent_inode);
-	free(dir_to_add);
+	free(dir_copy);
 	free(parent);
-
-	return 0;
+	return ret;
 }
 
 static int rufs_rmdir(const char *path) {
@@ -498,165 +3959,96 @@ static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {
 static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
 
 	// Step 1: Use dirname() and basename() to separate parent directory path and target file name
-	char *parent = malloc(strlen(path) + 1);
-    strcpy(parent, path);
-    dirname(parent);
-    char *file_to_add = malloc(strlen(path) + 1);
-    strcpy(file_to_add, path);
+	char *parent = strdup(path);
+	dirname(parent);
+	char *file_copy = strdup(path);
+	char *file_name = basename(file_copy);
 
-    char *file_copy = malloc(strlen(path) + 1);
-    strcpy(file_copy, path);
-    char *file_name = basename(file_copy);
-
-    strcpy(file_to_add, file_name);
-	free(file_copy);
-
-	// Step 2: Call get_node_by_path() to get inode of parent directory
-	struct inode *parent_inode = malloc(sizeof(struct inode));
-	if(get_node_by_path(parent, 0, parent_inode) != 0){
-		free(parent_inode);
-		free(file_to_add);
-		free(parent);
-		return -ENOENT;
+	// Step 2: Call get_ino_by_path() to get inode of parent directory
+	int parent_ino = get_ino_by_path(parent, 0);
+	int ret = -ENOENT;
+	if(parent_ino >= 0){
+		// Step 3: Create the file, its pin is handed to the file handle
+		struct inode *just_added_file;
+		ret = node_create(parent_ino, file_name, FT_FILE, &just_added_file);
+		if(ret == 0){
+			fi->fh = file_open(just_added_file);
+		}
 	}
-
-	// Step 3: Call get_avail_ino() to get an available inode number
-	int ino_available = get_avail_ino();
-	// Step 4: Call dir_add() to add directory entry of target file to parent directory
-	dir_add(*parent_inode, ino_available, file_to_add, strlen(file_to_add));
-	// Step 5: Update inode for target file
-	struct inode *just_added_file = malloc(sizeof(struct inode));
-	readi(ino_available,just_added_file);
-	just_added_file->ino = ino_available;
-	just_added_file->valid = VALID;
-	just_added_file->type = 0;
-	just_added_file->size = 0;
-	just_added_file->vstat.st_mode = S_IFREG | 0666;
-
-	// Step 6: Call writei() to write inode to disk
-	writei(ino_available, just_added_file);
-	free(just_added_file);
-	free(parent_inode);
-	free(file_to_add);
+	free(file_copy);
 	free(parent);
-	return 0;
+	return ret;
 }
 
 static int rufs_open(const char *path, struct fuse_file_info *fi) {
 
-	struct inode *inode_lookup = malloc(sizeof(struct inode));
-	// Step 1: Call get_node_by_path() to get inode from path
-	if(get_node_by_path(path, 0, inode_lookup) == 0){
-		//success
-		free(inode_lookup);
+	// Step 1: Call get_ino_by_path() to look the path up
+	int ino = get_ino_by_path(path, 0);
+	if(ino >= 0){
+		// Step 2: Keep the inode pinned in the handle for read/write/release
+		fi->fh = file_open(iget(ino));
 		return 0;
 	}
-	// Step 2: If not find, return -1
-	free(inode_lookup);
+	// Step 3: If not find, return -1
     return -ENOENT;
 }
 
 static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode* file_inode = malloc(sizeof(struct inode));
-	if(get_node_by_path(path, 0, file_inode) != 0) {
+	// Step 1: Take the inode from the file handle (or the path)
+	struct inode* file_inode = file_get(path, fi);
+	if(file_inode == NULL) {
 		return -ENOENT;
 	}
 
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int blocksToRead = (size % BLOCK_SIZE == 0) ? size / BLOCK_SIZE : (size / BLOCK_SIZE) + 1;
-	int bytesRead = 0;
-	int block = offset / BLOCK_SIZE;
-	for(int i = 0; i < blocksToRead; i++) {
-		if(file_inode->direct_ptr[i] == 0) {
-			if(i > 0) {
-				time(&(file_inode->vstat.st_atime));
-				writei(file_inode->ino, file_inode);
-			}
-			free(file_inode);
-			return bytesRead;
-		}
-		else {
-			void* tempBuf = malloc(BLOCK_SIZE);
-			bio_read(file_inode->direct_ptr[block], tempBuf);
-			int offsetDiff = BLOCK_SIZE - (offset % BLOCK_SIZE);
-			int bytesToRead = (size >= offsetDiff) ? offsetDiff : size;
-			memcpy(buffer + bytesRead, tempBuf + (offset % BLOCK_SIZE), bytesToRead);
-			size -= bytesToRead;
-			bytesRead += bytesToRead;
-
-			offset = 0;
-			block++;	
-			free(tempBuf);
-		}
-	}
-
-	time(&(file_inode->vstat.st_atime));
-	writei(file_inode->ino, file_inode);
-	free(file_inode);
+	// Step 2: Read through the extent map
+	int ret = file_read(file_inode, buffer, size, offset, file_ra(fi));
+	file_put(file_inode, fi);
 	// Note: this function should return the amount of bytes you read from disk
-	return bytesRead;
+	return ret;
 }
 
 static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-	// Note: this function should return the amount of bytes you write to disk
-
-	// Step 1: You could call get_node_by_path() to get inode from path
-	struct inode* file_inode = malloc(sizeof(struct inode));
-	if(get_node_by_path(path, 0, file_inode) != 0) {
+	// Step 1: Take the inode from the file handle (or the path)
+	struct inode* file_inode = file_get(path, fi);
+	if(file_inode == NULL) {
 		return -ENOENT;
 	}
 
-	// Step 2: Based on size and offset, read its data blocks from disk
-	int blocksToWrite = (size % BLOCK_SIZE == 0) ? size / BLOCK_SIZE : (size / BLOCK_SIZE) + 1;
-	int bytesWritten = 0;
-	int block = offset / BLOCK_SIZE;
-	for(int i = 0; i < blocksToWrite && i < DIRECT_PTR_SIZE; i++) {
-		char* tempBuf = malloc(BLOCK_SIZE);
-		if(file_inode->direct_ptr[block] == 0) {
-			int newBlock = get_avail_blkno();
-			file_inode->direct_ptr[block] = newBlock;
-			
-			int offsetDiff = BLOCK_SIZE - (offset % BLOCK_SIZE);
-			int bytesToWrite = (size >= offsetDiff) ? offsetDiff : size;
-
-			memcpy(tempBuf + (offset % BLOCK_SIZE), buffer + bytesWritten, BLOCK_SIZE);
-			size -= bytesToWrite;
-			bytesWritten += bytesToWrite;
-			file_inode->size += bytesToWrite;
-
-			bio_write(newBlock, tempBuf);
-			free(tempBuf);
-		}
-		else {
-			bio_read(file_inode->direct_ptr[block], tempBuf);
-			int offsetDiff = BLOCK_SIZE - (offset % BLOCK_SIZE);
-			int bytesToWrite = (size >= offsetDiff) ? offsetDiff : size; 
+	// Step 2: Write through the extent map, allocating as needed
+	int ret = file_write(file_inode, buffer, size, offset);
+	file_put(file_inode, fi);
+	// Note: this function should return the amount of bytes you write to disk
+	return ret;
+}
 
-			memcpy(tempBuf + (offset % BLOCK_SIZE), buffer + bytesWritten, bytesToWrite);
-			size -= bytesToWrite;
-			bytesWritten += bytesToWrite;
-			file_inode->size += bytesToWrite;
+static int rufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
 
-			bio_write(file_inode->direct_ptr[block], tempBuf);
-			free(tempBuf);
-		}
-		offset = 0;
-		block++;	
+	// Step 1: Take the inode from the file handle (or the path)
+	struct inode* file_inode = file_get(path, fi);
+	if(file_inode == NULL) {
+		return -ENOENT;
 	}
 
-	// Step 3: Write the correct amount of data from offset to disk
+	// Step 2: Hand libfuse a description of the data, it does the copy or splice
+	int ret = file_read_buf(file_inode, bufp, size, offset, file_ra(fi));
+	file_put(file_inode, fi);
+	return ret;
+}
 
-	// Step 4: Update the inode info and write it to disk
- 	time(&(file_inode->vstat.st_mtime));
-	file_inode->vstat.st_size += bytesWritten;
-	writei(file_inode->ino, file_inode);
-	free(file_inode);
+static int rufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
 
-	// Note: this function should return the amount of bytes you write to disk
-	return bytesWritten;
+	// Step 1: Take the inode from the file handle (or the path)
+	struct inode* file_inode = file_get(path, fi);
+	if(file_inode == NULL) {
+		return -ENOENT;
+	}
+
+	// Step 2: Whole blocks go from the request to the disk file directly
+	int ret = file_write_buf(file_inode, buf, offset);
+	file_put(file_inode, fi);
+	return ret;
 }
 
 static int rufs_unlink(const char *path) {
@@ -677,21 +4069,67 @@ static int rufs_unlink(const char *path) {
 }
 
 static int rufs_truncate(const char *path, off_t size) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Step 1: Call get_ino_by_path() to get the inode of the file
+	int ino = get_ino_by_path(path, 0);
+	if(ino < 0){
+		return -ENOENT;
+	}
+
+	// Step 2: Free or zero what lies past the new size
+	struct inode *file_inode = iget(ino);
+	int ret = file_truncate(file_inode, size);
+	iput(file_inode);
+	return ret;
+}
+
+static int rufs_ftruncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	struct inode *file_inode = file_get(path, fi);
+	if(file_inode == NULL){
+		return -ENOENT;
+	}
+	int ret = file_truncate(file_inode, size);
+	file_put(file_inode, fi);
+	return ret;
+}
+
+static int rufs_fallocate(const char *path, int mode, off_t offset, off_t len, struct fuse_file_info *fi) {
+	struct inode *file_inode = file_get(path, fi);
+	if(file_inode == NULL){
+		return -ENOENT;
+	}
+	int ret = file_fallocate(file_inode, mode, offset, len);
+	file_put(file_inode, fi);
+	return ret;
 }
 
 static int rufs_release(const char *path, struct fuse_file_info *fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-	return 0;
+	// Allocate the file's delayed blocks and drop the pin taken by open()/create()
+	int ret = file_flush(fi);
+	file_close(fi);
+	// Write back the metadata changed so far
+	if(fs_commit(0) != 0){
+		return -EIO;
+	}
+	return ret;
 }
 
 static int rufs_flush(const char * path, struct fuse_file_info * fi) {
-	// For this project, you don't need to fill this function
-	// But DO NOT DELETE IT!
-    return 0;
+	// Allocate the file's delayed blocks, then write back the metadata changed so far
+	int ret = file_flush(fi);
+	if(fs_commit(0) != 0){
+		return -EIO;
+	}
+    return ret;
+}
+
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	// Allocate the file's delayed blocks, then make the metadata and data
+	// durable on the disk file
+	int ret = file_flush(fi);
+	if(fs_commit(1) != 0){
+		return -EIO;
+	}
+	return ret;
 }
 
 static int rufs_utimens(const char *path, const struct timespec tv[2]) {
@@ -716,22 +4154,364 @@ static struct fuse_operations rufs_ope = {
 	.open		= rufs_open,
 	.read 		= rufs_read,
 	.write		= rufs_write,
+	.read_buf	= rufs_read_buf,
+	.write_buf	= rufs_write_buf,
 	.unlink		= rufs_unlink,
 
 	.truncate   = rufs_truncate,
+	.ftruncate	= rufs_ftruncate,
+	.fallocate	= rufs_fallocate,
 	.flush      = rufs_flush,
+	.fsync      = rufs_fsync,
 	.utimens    = rufs_utimens,
 	.release	= rufs_release
 };
 
 
+/* 
+ * FUSE low-level operations
+ *
+ * The same filesystem driven by inode numbers instead of paths, selected
+ * with --lowlevel. The kernel names every file by the number lookup()
+ * handed out, so each request costs one inode cache probe however deep
+ * the file is. FUSE reserves 1 for the root, so FUSE numbers are ours + 1.
+ */
+#define LL_INO(ino)		((fuse_ino_t) (ino) + 1)
+#define RUFS_INO(fino)	((uint32_t) ((fino) - 1))
+#define LL_TIMEOUT		1.0
+
+static void ll_stat(struct inode *inode, struct stat *stbuf) {
+	irdlock(inode);
+	inode_stat(inode, stbuf);
+	iunlock(inode);
+	stbuf->st_ino = LL_INO(inode->ino);
+}
+
+static void ll_reply_entry(fuse_req_t req, struct inode *inode) {
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = LL_INO(inode->ino);
+	e.attr_timeout = LL_TIMEOUT;
+	e.entry_timeout = LL_TIMEOUT;
+	ll_stat(inode, &e.attr);
+	fuse_reply_entry(req, &e);
+}
+
+static void rufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+	rufs_init(conn);
+}
+
+static void rufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+	size_t len = strlen(name);
+	if(len > NAME_LEN_MAX){
+		fuse_reply_err(req, ENAMETOOLONG);
+		return;
+	}
+	struct inode *dir_inode = iget(RUFS_INO(parent));
+	int isdir = S_ISDIR(dir_inode->mode);
+	iput(dir_inode);
+	if(!isdir){
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	int ino = dir_lookup(RUFS_INO(parent), name, len);
+	if(ino < 0){
+		fuse_reply_err(req, ENOENT);
+		return;
+	}
+	struct inode *inode = iget(ino);
+	ll_reply_entry(req, inode);
+	iput(inode);
+}
+
+static void rufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+	// Inodes are never deleted, so there is nothing to keep alive for the kernel
+	fuse_reply_none(req);
+}
+
+static void rufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	struct stat st;
+	struct inode *inode = iget(RUFS_INO(ino));
+	ll_stat(inode, &st);
+	iput(inode);
+	fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
+
+static void rufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+	// Step 1: Only what the inode keeps can be set
+	int known = FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID | FUSE_SET_ATTR_SIZE
+		| FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+	if(to_set & ~known){
+		fuse_reply_err(req, EOPNOTSUPP);
+		return;
+	}
+
+	// Step 2: A size change is a truncate()
+	struct inode *inode = iget(RUFS_INO(ino));
+	if(to_set & FUSE_SET_ATTR_SIZE){
+		int ret = file_truncate(inode, attr->st_size);
+		if(ret < 0){
+			iput(inode);
+			fuse_reply_err(req, -ret);
+			return;
+		}
+	}
+
+	// Step 3: Permission bits, owner and times
+	if(to_set & ~FUSE_SET_ATTR_SIZE){
+		time_t now = time(NULL);
+		if(journal_start() < 0){
+			iput(inode);
+			fuse_reply_err(req, EIO);
+			return;
+		}
+		iwrlock(inode);
+		if(to_set & FUSE_SET_ATTR_MODE){
+			inode->mode = (inode->mode & S_IFMT) | (attr->st_mode & 07777);
+		}
+		if(to_set & FUSE_SET_ATTR_UID){
+			inode->uid = attr->st_uid;
+		}
+		if(to_set & FUSE_SET_ATTR_GID){
+			inode->gid = attr->st_gid;
+		}
+		if(to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_ATIME_NOW)){
+			__atomic_store_n(&inode->atime, to_set & FUSE_SET_ATTR_ATIME_NOW ? now : attr->st_atime, __ATOMIC_RELAXED);
+		}
+		if(to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)){
+			inode->mtime = to_set & FUSE_SET_ATTR_MTIME_NOW ? now : attr->st_mtime;
+		}
+		inode->ctime = now;
+		iunlock(inode);
+		imark_dirty(inode);
+		if(journal_stop() < 0){
+			iput(inode);
+			fuse_reply_err(req, EIO);
+			return;
+		}
+	}
+	iput(inode);
+	rufs_ll_getattr(req, ino, fi);
+}
+
+struct ll_dirbuf {
+	fuse_req_t	req;
+	char		*buf;
+	size_t		size;
+	size_t		used;
+};
+
+static int ll_fill(void *buffer, const char *name, const struct stat *stbuf, off_t off) {
+	struct ll_dirbuf *db = buffer;
+	struct stat st = *stbuf;
+	st.st_ino = LL_INO(st.st_ino);
+	size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name, &st, off);
+	if(len > db->size - db->used){
+		return 1;
+	}
+	db->used += len;
+	return 0;
+}
+
+static void rufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct inode *inode = iget(RUFS_INO(ino));
+	if(!S_ISDIR(inode->mode)){
+		iput(inode);
+		fuse_reply_err(req, ENOTDIR);
+		return;
+	}
+	struct ll_dirbuf db = { .req = req, .buf = malloc(size), .size = size, .used = 0 };
+	dir_iterate(inode, off, ll_fill, &db);
+	iput(inode);
+	fuse_reply_buf(req, db.buf, db.used);
+	free(db.buf);
+}
+
+static void rufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+	struct inode *inode;
+	int ret = node_create(RUFS_INO(parent), name, FT_DIR, &inode);
+	if(ret != 0){
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	ll_reply_entry(req, inode);
+	iput(inode);
+}
+
+static void rufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+	struct inode *inode;
+	int ret = node_create(RUFS_INO(parent), name, FT_FILE, &inode);
+	if(ret != 0){
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+	e.ino = LL_INO(inode->ino);
+	e.attr_timeout = LL_TIMEOUT;
+	e.entry_timeout = LL_TIMEOUT;
+	ll_stat(inode, &e.attr);
+	fi->fh = file_open(inode);
+	fuse_reply_create(req, &e, fi);
+}
+
+static void rufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fi->fh = file_open(iget(RUFS_INO(ino)));
+	fuse_reply_open(req, fi);
+}
+
+static void rufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+	struct fuse_bufvec *bufv;
+	int ret = file_read_buf(file_handle(fi)->inode, &bufv, size, off, file_ra(fi));
+	if(ret < 0){
+		fuse_reply_err(req, -ret);
+		return;
+	}
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	for(size_t i = 0; i < bufv->count; i++){
+		free(bufv->buf[i].mem);
+	}
+	free(bufv);
+}
+
+static void rufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+	int ret = file_write(file_handle(fi)->inode, buf, size, off);
+	if(ret < 0){
+		fuse_reply_err(req, -ret);
+	}
+	else {
+		fuse_reply_write(req, ret);
+	}
+}
+
+static void rufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+	int ret = file_write_buf(file_handle(fi)->inode, bufv, off);
+	if(ret < 0){
+		fuse_reply_err(req, -ret);
+	}
+	else {
+		fuse_reply_write(req, ret);
+	}
+}
+
+static void rufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -rufs_flush(NULL, fi));
+}
+
+static void rufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -rufs_release(NULL, fi));
+}
+
+static void rufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -rufs_fsync(NULL, datasync, fi));
+}
+
+static void rufs_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	fuse_reply_err(req, -file_fallocate(file_handle(fi)->inode, mode, offset, length));
+}
+
+static void rufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_open(req, fi);
+}
+
+static void rufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+	fuse_reply_err(req, 0);
+}
+
+static struct fuse_lowlevel_ops rufs_ll_ope = {
+	.init		= rufs_ll_init,
+	.destroy	= rufs_destroy,
+
+	.lookup		= rufs_ll_lookup,
+	.forget		= rufs_ll_forget,
+	.getattr	= rufs_ll_getattr,
+	.setattr	= rufs_ll_setattr,
+	.readdir	= rufs_ll_readdir,
+	.opendir	= rufs_ll_opendir,
+	.releasedir	= rufs_ll_releasedir,
+	.mkdir		= rufs_ll_mkdir,
+
+	.create		= rufs_ll_create,
+	.open		= rufs_ll_open,
+	.read		= rufs_ll_read,
+	.write		= rufs_ll_write,
+	.write_buf	= rufs_ll_write_buf,
+	.flush		= rufs_ll_flush,
+	.fsync		= rufs_ll_fsync,
+	.release	= rufs_ll_release,
+	.fallocate	= rufs_ll_fallocate
+};
+
+static int rufs_ll_main(int argc, char *argv[]) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	struct fuse_chan *ch;
+	char *mountpoint;
+	int multithreaded, foreground;
+	int err = -1;
+
+	if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1){
+		return 1;
+	}
+	if((ch = fuse_mount(mountpoint, &args)) != NULL){
+		struct fuse_session *se = fuse_lowlevel_new(&args, &rufs_ll_ope, sizeof(rufs_ll_ope), NULL);
+		if(se != NULL){
+			if(fuse_set_signal_handlers(se) != -1){
+				fuse_session_add_chan(se, ch);
+				fuse_daemonize(foreground);
+				err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	fuse_opt_free_args(&args);
+	return err ? 1 : 0;
+}
+
+
 int main(int argc, char *argv[]) {
 	int fuse_stat;
+	int lowlevel = 0;
 
 	getcwd(diskfile_path, PATH_MAX);
 	strcat(diskfile_path, "/DISKFILE");
 
-	fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	// --mmap and --uring select the disk backend and --lowlevel the inode
+	// number frontend. --nodiscard keeps freed blocks in the disk file and
+	// --trim punches every free one out at mount. They are not FUSE options
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "--lowlevel") == 0){
+			lowlevel = 1;
+		}
+		else if(strcmp(argv[i], "--nodiscard") == 0){
+			discard_enabled = 0;
+		}
+		else if(strcmp(argv[i], "--trim") == 0){
+			discard_at_mount = 1;
+		}
+		else if(strcmp(argv[i], "--mmap") == 0){
+			dev_use_mmap(1);
+		}
+		else if(strcmp(argv[i], "--uring") == 0){
+			dev_use_uring(1);
+		}
+		else {
+			continue;
+		}
+		memmove(&argv[i], &argv[i + 1], (argc - i) * sizeof(char *));
+		argc--;
+		i--;
+	}
+
+	if(lowlevel){
+		fuse_stat = rufs_ll_main(argc, argv);
+	}
+	else {
+		fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+	}
 
 	return fuse_stat;
 }
@@ -13,57 +13,239 @@
 #ifndef _TFS_H
 #define _TFS_H
 
-#define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
-#define DIRECT_PTR_SIZE 16
+#define MAGIC_NUM 0x5C41
 #define VALID 1
 
+// Geometry used when a missing disk file is created at mount; mkfs.rufs
+// takes its own
+#ifndef DISK_SIZE
+#define DISK_SIZE (64 * 1024 * 1024)
+#endif
+
+// Blocks set aside for the metadata journal at mkfs
+#ifndef JOURNAL_BLOCKS
+#define JOURNAL_BLOCKS 1024
+#endif
+
+// Largest write and readahead asked of the kernel at mount
+#ifndef RUFS_MAX_WRITE
+#define RUFS_MAX_WRITE (128 * 1024)
+#endif
+#ifndef RUFS_MAX_READAHEAD
+#define RUFS_MAX_READAHEAD (128 * 1024)
+#endif
+
+// Our own readahead window, in blocks: where a stream starts and how far it grows
+#ifndef RA_INIT_BLOCKS
+#define RA_INIT_BLOCKS 8
+#endif
+#ifndef RA_MAX_BLOCKS
+#define RA_MAX_BLOCKS 256
+#endif
+
+// Blocks a file may hold back in memory before their allocation is forced,
+// and all files together
+#ifndef DELALLOC_MAX_BLOCKS
+#define DELALLOC_MAX_BLOCKS 256
+#endif
+#ifndef DELALLOC_TOTAL_BLOCKS
+#define DELALLOC_TOTAL_BLOCKS 8192
+#endif
+
 
 
+/*
+ * The superblock sits at the start of block 0. It is read with the
+ * smallest block size before the disk is reopened with the one it names,
+ * so it must fit in BLOCK_SIZE_MIN bytes.
+ *
+ * The inode table is not laid out at mkfs. It is made of chunks of
+ * i_chunk_inodes inodes, each a contiguous run of blocks taken from the
+ * data region the first time one of its inodes is needed; i_chunk_blk[c]
+ * is where chunk c starts, or 0 until then. The inodes of a chunk that is
+ * not there yet are marked in use in the inode bitmap, so only max_inum,
+ * the size of the bitmap, is fixed at mkfs.
+ */
+#define INODE_CHUNKS_MAX 1008
+#define INODE_CHUNK_MIN 256
+
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
+	uint32_t	block_size;			/* bytes per block */
+	uint32_t	max_inum;			/* most inodes there can be, a multiple of i_chunk_inodes */
+	uint32_t	max_dnum;			/* number of blocks on the disk, metadata included */
 	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
-	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	j_start_blk;		/* start block of the journal */
+	uint32_t	j_blocks;			/* size of the journal in blocks */
+	uint32_t	group_blocks;		/* blocks per allocation group, a multiple of 64 */
+	uint32_t	group_inodes;		/* inodes per allocation group, a multiple of i_chunk_inodes */
+	uint32_t	inode_size;			/* bytes per inode table record, INODE_SIZE_MIN to INODE_SIZE_MAX */
+	uint32_t	i_chunk_inodes;		/* inodes per inode table chunk, a multiple of 64 and of a block's worth */
+	uint32_t	i_chunk_blk[INODE_CHUNKS_MAX];	/* first block of each inode table chunk, 0 if not allocated */
+};
+
+/* blocks taken by a bitmap of nbits bits */
+#define BITMAP_BLOCKS(nbits) (((nbits) + 8 * BLOCK_SIZE - 1) / (8 * BLOCK_SIZE))
+
+/* disk geometry asked of rufs_format(), which fills in the fields left 0 */
+struct rufs_geometry {
+	off_t		disk_size;			/* bytes, rounded down to whole blocks */
+	int			block_size;			/* power of two, BLOCK_SIZE_MIN to BLOCK_SIZE_MAX */
+	uint32_t	max_inum;			/* most inodes, 0 for one per block */
+	uint32_t	j_blocks;			/* journal size in blocks */
+	uint32_t	group_blocks;		/* blocks per allocation group, 0 to pick one */
+	uint32_t	inode_size;			/* bytes per inode, 0 for INODE_SIZE_DEFAULT */
+};
+
+int rufs_format(const char *path, struct rufs_geometry *geo);
+
+/*
+ * extent tree
+ *
+ * A file's blocks are described by extents, each mapping a run of logical
+ * blocks to a run of physical ones. The root node lives in the inode; once
+ * it overflows, its records move to a block and the root indexes it. In an
+ * index node (depth > 0) pblk is the child node and len is unused.
+ */
+struct extent {
+	uint32_t	lblk;				/* first logical block */
+	uint32_t	pblk;				/* first physical block, or child node */
+	uint32_t	len;				/* number of blocks */
+};
+
+struct extent_header {
+	uint16_t	count;				/* records in use */
+	uint16_t	depth;				/* levels below this node, 0 for a leaf */
 };
 
+#define EXTENT_NODE_MAX ((BLOCK_SIZE - sizeof(struct extent_header)) / sizeof(struct extent))
+
+/* logical block UINT32_MAX stands for "the end of the file", no block is mapped there */
+#define FILE_SIZE_MAX ((off_t) UINT32_MAX * BLOCK_SIZE)
+
+/*
+ * on-disk inode
+ *
+ * The inode table holds superblock->inode_size byte records, a power of two
+ * from INODE_SIZE_MIN to INODE_SIZE_MAX. Each starts with a fixed-width
+ * header; i_block takes up the rest of the record and holds the root of the
+ * extent tree or, for a small regular file, its contents (INODE_INLINE). A
+ * record that is not in use is all zeros, version included.
+ */
+#define DINODE_VERSION 1
+
+#define INODE_SIZE_MIN 128
+#define INODE_SIZE_MAX 256
+#define INODE_SIZE_DEFAULT 256
+
+#define INODE_INLINE 0x1				/* contents are in inline_data, there is no extent tree */
+
+struct dinode {
+	uint8_t		version;			/* DINODE_VERSION, 0 if the record is free */
+	uint8_t		pad;
+	uint16_t	flags;				/* INODE_* flags */
+	uint32_t	mode;				/* type and permission bits */
+	uint32_t	links;				/* link count */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint32_t	blocks;				/* blocks in use, extent tree nodes included */
+	uint32_t	dir_index;			/* root block of the directory hash index, 0 if none */
+	uint32_t	reserved;
+	uint64_t	size;				/* size of the file in bytes */
+	int64_t		atime;				/* last access, seconds since the epoch */
+	int64_t		mtime;				/* last modification */
+	int64_t		ctime;				/* last status change */
+	uint8_t		i_block[];			/* extent tree root or inline data, to the end of the record */
+} __attribute__((packed));
+
+/* bytes of i_block in a record of the given size */
+#define INODE_IBLOCK(inode_size) ((inode_size) - sizeof(struct dinode))
+/* extent records the root in i_block has room for */
+#define INODE_EXTENTS(inode_size) ((INODE_IBLOCK(inode_size) - sizeof(struct extent_header)) / sizeof(struct extent))
+
+/*
+ * In-memory inode, loaded from and stored back to its struct dinode by the
+ * inode cache. The extent root and inline data are sized for the largest
+ * record; only the first INODE_IBLOCK(superblock->inode_size) bytes are
+ * kept on disk.
+ */
 struct inode {
-	uint16_t	ino;				/* inode number */
+	uint32_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint16_t	flags;				/* INODE_* flags */
+	uint64_t	size;				/* size of the file */
+	uint32_t	mode;				/* type and permission bits */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[16];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	uint32_t	uid;				/* owner */
+	uint32_t	gid;				/* group */
+	uint32_t	blocks;				/* blocks in use */
+	int			dir_index;			/* root block of the directory hash index, 0 if none */
+	int64_t		atime;				/* access, modification and status change times */
+	int64_t		mtime;
+	int64_t		ctime;
+	union {
+		struct {
+			struct extent_header ext_hdr;	/* root of the extent tree */
+			struct extent extents[INODE_EXTENTS(INODE_SIZE_MAX)];
+		};
+		char	inline_data[INODE_IBLOCK(INODE_SIZE_MAX)];	/* contents of an INODE_INLINE file */
+	};
 };
 
 struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
-	uint16_t valid;					/* validity of the directory entry */
-	char name[208];					/* name of the directory entry */
-	uint16_t len;					/* length of name */
+	uint32_t ino;					/* inode number of the directory entry */
+	uint32_t rec_len;				/* bytes from this record to the next one */
+	uint8_t name_len;				/* length of name */
+	uint8_t type;					/* FT_* type of the entry, FT_FREE if unused */
+	char name[];					/* name of the directory entry, not NUL-terminated */
+};
+
+#define FT_FREE 0
+#define FT_FILE 1
+#define FT_DIR 2
+
+#define NAME_LEN_MAX 255
+/* on-disk length of a record holding a name_len byte name, 4-byte aligned */
+#define DIRENT_LEN(name_len) ((sizeof(struct dirent) + (name_len) + 3) & ~3)
+/* room for a record plus a terminating NUL, as returned by dir_find() */
+#define DIRENT_MAX (sizeof(struct dirent) + NAME_LEN_MAX + 1)
+
+/*
+ * hashed directory index
+ */
+#define DX_MAGIC 0xD1C5
+
+struct dx_entry {
+	uint32_t hash;					/* lowest name hash stored in block */
+	uint32_t block;					/* leaf directory block */
 };
 
+struct dx_root {
+	uint16_t magic;					/* DX_MAGIC */
+	uint16_t count;					/* number of entries in use */
+	uint32_t reserved;
+	struct dx_entry entries[];		/* sorted by hash, entries[0].hash is 0 */
+};
+
+#define DX_LIMIT ((BLOCK_SIZE - sizeof(struct dx_root)) / sizeof(struct dx_entry))
+
 
 /*
  * bitmap operations
  */
 typedef unsigned char* bitmap_t;
 
-void set_bitmap(bitmap_t b, int i) {
+static inline void set_bitmap(bitmap_t b, int i) {
     b[i / 8] |= 1 << (i & 7);
 }
 
-void unset_bitmap(bitmap_t b, int i) {
+static inline void unset_bitmap(bitmap_t b, int i) {
     b[i / 8] &= ~(1 << (i & 7));
 }
 
-uint8_t get_bitmap(bitmap_t b, int i) {
+static inline uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 